@@ -7,9 +7,13 @@
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
+#include "headless-runner.hpp"
+#include "slurp.hpp"
+
 using namespace al;
 
 static const int numParticles = 1500;
+static const int maxTrailLength = 100;
 
 Vec3f sphereToCar(float t, float p) {
     float x = sin(t) * cos(p);
@@ -44,84 +48,56 @@ void setMeshColor(Mesh &m, Color c) {
     }
 }
 
-std::string slurp(std::string fileName) {
-  std::fstream file(fileName);
-  std::string returnValue = "";
-  while (file.good()) {
-    std::string line;
-    getline(file, line);
-    returnValue += line + "\n";
-  }
-  return returnValue;
-}
+// circular history of particle positions, one frame of numParticles points
+// per slot, all allocated up front. pushing and dropping the oldest frame
+// are O(1) and nothing is copied but the new positions
+struct FrameHistory {
+    std::vector<Vec3f> positions; // maxTrailLength frames of numParticles points
+    int head = -1; // slot of the newest frame
+    int length = 0;
 
-struct MeshNode {
-    Mesh mesh;
-    MeshNode* next;
+    FrameHistory() : positions(maxTrailLength * numParticles) {}
 
-    MeshNode() {
-        mesh.reset();
-        next = NULL;
+    void push(const float (*particles)[3]) {
+        head = (head + 1) % maxTrailLength;
+        Vec3f* slot = &positions[head * numParticles];
+        for (int i = 0; i < numParticles; i++) {
+            slot[i].set(particles[i][0], particles[i][1], particles[i][2]);
+        }
+        if (length < maxTrailLength) {
+            length++;
+        }
     }
 
-    MeshNode(Mesh m) {
-        mesh = m;
-        next = NULL;
+    void popOldest() {
+        if (length > 0) {
+            length--;
+        }
     }
-};
-
-struct LinkedList {
-    MeshNode* head;
-    int length;
 
-    LinkedList() {
-        head = NULL;
-        length = 0;
+    // drops the oldest frames until one more push keeps at most trailLength,
+    // stopping at empty so a trailLength of 0 can't loop forever
+    void makeRoom(int trailLength) {
+        while (length > 0 && length >= trailLength) {
+            popOldest();
+        }
     }
 
-    void insertNode(Mesh m, bool first) {
-        MeshNode* newNode = new MeshNode(m);
-        if (!head) {
-            head = newNode;
-        }
-        else {
-            MeshNode* temp = head;
-            if (first) {
-                head = newNode;
-                head->next = temp;
-            }
-            else {
-                while (temp->next) {
-                    temp = temp->next;
-                }
-                temp->next = newNode;
-            }
-        }
-        length++;
+    // age 0 is the newest frame
+    const Vec3f* frame(int age) const {
+        return &positions[((head - age + maxTrailLength) % maxTrailLength) * numParticles];
     }
 
-    void deleteNode(bool first) {
-        if (!head) {
-            return;
-        }
-        if (first) {
-            MeshNode* temp = head;
-            head = temp->next;
-            delete temp;
-        }
-        else {
-            MeshNode* temp1 = head;
-            MeshNode* temp2 = NULL;
-            while (temp1->next) {
-                temp2 = temp1;
-                temp1 = temp1->next;
-            }
-            delete temp1;
-            if (temp2) {
-                temp2->next = NULL;
+    // appends every stored frame to m, fading out with age
+    void merge(Mesh &m) const {
+        for (int age = 0; age < length; age++) {
+            const Vec3f* f = frame(age);
+            Color c(1.0f, 1.0f, 1.0f, 1.0f-age/(float)length);
+            for (int i = 0; i < numParticles; i++) {
+                m.vertex(f[i]);
+                m.color(c);
             }
         }
-        length--;
     }
 };
 
@@ -132,11 +108,12 @@ struct CommonState {
 struct MyApp : DistributedAppWithState<CommonState> {
     Parameter theta{"theta", "", 0, -M_PI, M_PI};
     Parameter phi{"phi", "", 0.0, -M_PI, M_PI};
-    Parameter trailLength{"trailLength", "", 30, 0, 100};
+    Parameter trailLength{"trailLength", "", 30, 0, maxTrailLength};
     Parameter speed{"speed", "", 0.5, 0.0, 2.0};
     Parameter pointSize{"pointSize", "", 4.0, 1.0, 10.0};
 
-    LinkedList meshList;
+    FrameHistory history;
+    Mesh finalMesh;
 
     ShaderProgram starShader;
 
@@ -179,12 +156,7 @@ void onInit() override {
 
     void onAnimate(double dt) override {
         if (isPrimary()) {
-            while (meshList.length >= trailLength) {
-                meshList.deleteNode(false);
-            }
-
-            Mesh newMesh;
-            newMesh.primitive(Mesh::POINTS);
+            history.makeRoom(trailLength);
 
             float amount = speed * dt;
 
@@ -193,12 +165,9 @@ void onInit() override {
                 state().particles[i][0] = newPoint[0];
                 state().particles[i][1] = newPoint[1];
                 state().particles[i][2] = newPoint[2];
-
-                newMesh.vertex(state().particles[i]);
-                newMesh.color(Color(1.0, 1.0));
             }
 
-            meshList.insertNode(newMesh, true);
+            history.push(state().particles);
         }
     }
 
@@ -208,14 +177,9 @@ void onInit() override {
         g.depthTesting(true);
         g.pointSize(pointSize);
         g.meshColor();
-        Mesh finalMesh;
+        finalMesh.reset();
         finalMesh.primitive(Mesh::POINTS);
-        // MeshNode* node = meshList.head;
-        // for (int i = 0; i < meshList.length; i++) {
-        //     setMeshColor(node->mesh, Color(1.0f, 1.0f, 1.0f, 1.0f-i/(float)(meshList.length)));
-        //     finalMesh.merge(node->mesh);
-        //     node = node->next;
-        // }
+        // history.merge(finalMesh);
         for (int i = 0; i < numParticles; i++) {
             finalMesh.vertex(state().particles[i]);
             finalMesh.color(1, 1, 1);
@@ -224,7 +188,77 @@ void onInit() override {
     }
 };
 
-int main() {
+// pushes frames numbered by their x so every check can tell which one it got
+void pushNumbered(FrameHistory &history, int number) {
+    static float particles[numParticles][3];
+    for (int i = 0; i < numParticles; i++) {
+        particles[i][0] = number;
+        particles[i][1] = i;
+        particles[i][2] = 0;
+    }
+    history.push(particles);
+}
+
+void checkFrameHistory(CheckResults& check) {
+    FrameHistory history;
+    int pushes = maxTrailLength + maxTrailLength / 2;
+    for (int n = 0; n < pushes; n++) {
+        pushNumbered(history, n);
+    }
+    check.expect(history.length == maxTrailLength && history.head == (pushes - 1) % maxTrailLength,
+                 "history: %d pushes keep %d frames, head wrapped to slot %d",
+                 pushes, history.length, history.head);
+
+    int misplaced = 0;
+    for (int age = 0; age < history.length; age++) {
+        const Vec3f* f = history.frame(age);
+        for (int i = 0; i < numParticles; i++) {
+            misplaced += f[i].x != pushes - 1 - age || f[i].y != i;
+        }
+    }
+    check.expect(misplaced == 0, "history: frame(age) newest to oldest after wrapping, %d points misplaced", misplaced);
+
+    history.makeRoom(10);
+    bool trimmed = history.length == 9 && history.frame(0)[0].x == pushes - 1;
+    while (history.length > 0) {
+        history.popOldest();
+    }
+    history.popOldest();
+    check.expect(trimmed && history.length == 0, "history: makeRoom keeps the newest frames, popOldest on empty stays empty");
+
+    history.makeRoom(0);
+    pushNumbered(history, 0);
+    history.makeRoom(0);
+    check.expect(history.length == 0, "history: makeRoom(0) returns and empties the history");
+
+    for (int n = 0; n < pushes; n++) {
+        pushNumbered(history, n);
+    }
+    Mesh mesh;
+    FrameTimings timings = runHeadless("history merge", maxTrailLength * numParticles, 50, 1 / 60.0, [&](double) {
+        mesh.reset();
+        history.merge(mesh);
+    });
+    bool newestFirst = mesh.vertices().size() == (size_t)(maxTrailLength * numParticles) &&
+                       mesh.vertices()[0].x == pushes - 1 &&
+                       mesh.vertices().back().x == pushes - maxTrailLength;
+    check.expect(newestFirst, "history: merge appends %d points newest first, %.2f ms",
+                 (int)mesh.vertices().size(), timings.median());
+}
+
+// `--check`: the trail history against frames with known contents
+int runChecks() {
+    CheckResults check;
+    checkFrameHistory(check);
+    return check.exitCode();
+}
+
+int main(int argc, char* argv[]) {
+    HeadlessOptions headless = parseHeadless(argc, argv);
+    if (headless.check) {
+        return runChecks();
+    }
+
     MyApp app;
     app.start();
-}
\ No newline at end of file
+}
@@ -8,14 +8,26 @@
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
+#include "run-config.hpp"
+#include "slurp.hpp"
+
 #define STB_PERLIN_IMPLEMENTATION
 #include "allolib/external/stb/stb/stb_perlin.h"
 
 using namespace al;
 using namespace std;
 
-static const int numParticles = 1500;
-static const int trailLength = 100;
+// capacities the distributed state is built for. the counts actually used
+// are picked at launch (see run-config.hpp), main runs the app with the
+// smallest capacity that holds them and renderers follow the state's size
+// header. Cuttlebone sends the whole state every frame however few particles
+// are in use, 12 bytes per particle of capacity: 18 KB at 1500, 240 KB at
+// 20000, so every node has to be started with the same counts to agree on it
+static const int smallCapacity = 1500;
+static const int maxParticles = 20000;
+static const int maxTrailLength = 1000;
+static int numParticles = 1500;
+static int trailLength = 100;
 static const float baseSpeed = 0.1;
 static const float speedBoost = 0.9;
 // const float radius = 1;
@@ -26,7 +38,6 @@ const float chaosOffset = 0.005;
 // const float alphaOffest = 0.2;
 const float noiseSpeed = 0.01;
 
-string slurp(string fileName);
 
 Vec3f sphereToCar(float t, float p) {
     float x = sin(t) * cos(p);
@@ -55,19 +66,32 @@ Vec3f rotatePoint(Vec3f point, float t, float p, float amt) {
     return newPoint;
 }
 
+template <int Capacity>
 struct CommonState {
-    Vec3f currentParticles[numParticles];
+    // size header: how much of currentParticles is in use
+    int numParticles;
+    int trailLength;
+    Vec3f currentParticles[Capacity];
     Nav primaryNav;
     float pointSize;
 };
 
-struct MyApp : DistributedAppWithState<CommonState> {
+template <int Capacity>
+struct MyApp : DistributedAppWithState<CommonState<Capacity>> {
+    using DistributedAppWithState<CommonState<Capacity>>::state;
+    using DistributedAppWithState<CommonState<Capacity>>::isPrimary;
+    using DistributedAppWithState<CommonState<Capacity>>::nav;
+    using DistributedAppWithState<CommonState<Capacity>>::quit;
+    using DistributedAppWithState<CommonState<Capacity>>::defaultWindowDomain;
+
     Parameter theta{"theta", "", 0.0, -M_PI, M_PI};
     Parameter phi{"phi", "", 0.0, -M_PI/2.0, M_PI/2.0};
     Parameter pointSize{"pointSize", "", 4.0, 1.0, 10.0};
     Parameter chaos{"chaos", "", 0.0, 0.0, 1.0};
+    Parameter radiusView{"radius", "", 1.0, 0.0, 2.1};  // shows radius, setting it has no effect
 
-    RingBuffer<Vec3f> particlePositions[numParticles];
+    vector<RingBuffer<Vec3f>> particlePositions;
+    Mesh trailMesh;
 
     int frame = 0;
 
@@ -77,7 +101,7 @@ struct MyApp : DistributedAppWithState<CommonState> {
 
     void onInit() override {
         auto cuttleboneDomain =
-        CuttleboneStateSimulationDomain<CommonState>::enableCuttlebone(this);
+        CuttleboneStateSimulationDomain<CommonState<Capacity>>::enableCuttlebone(this);
         if (!cuttleboneDomain) {
             std::cerr << "ERROR: Could not start Cuttlebone. Quitting." << std::endl;
             quit();
@@ -89,11 +113,25 @@ struct MyApp : DistributedAppWithState<CommonState> {
             gui.add(phi);
             gui.add(pointSize);
             gui.add(chaos);
+            gui.add(radiusView);
+        }
+    }
+
+    // sizes the trail buffers; allocates, so it only runs at startup and
+    // when a renderer sees a new size header
+    void resize(int newNumParticles, int newTrailLength) {
+        numParticles = min(newNumParticles, Capacity);
+        trailLength = min(newTrailLength, maxTrailLength);
+        particlePositions.resize(numParticles);
+        for (int i = 0; i < numParticles; i++) {
+            particlePositions[i].resize(trailLength);
         }
     }
 
     void onCreate() override {
         if (isPrimary()) {
+            state().numParticles = numParticles;
+            state().trailLength = trailLength;
             for (int i = 0; i < numParticles; i++) {
                 Vec3f pos = rnd::ball<Vec3f>() * radius;
                 state().currentParticles[i] =  pos;
@@ -103,9 +141,7 @@ struct MyApp : DistributedAppWithState<CommonState> {
             state().primaryNav.faceToward(0,0,0);
         }
 
-        for (int i = 0; i < numParticles; i++) {
-            particlePositions[i].resize(trailLength);
-        }
+        resize(numParticles, trailLength);
 
         // starShader.compile(slurp("../star-vertex.glsl"),
         //                 slurp("../star-fragment.glsl"),
@@ -137,9 +173,14 @@ struct MyApp : DistributedAppWithState<CommonState> {
             state().pointSize = pointSize;
 
             radius = stb_perlin_noise3(frame*noiseSpeed, 0, 0, 0, 0, 0) + 1.0001;
-            cout << radius << endl;
+            radiusView.set(radius);
             frame++;
         }
+
+        if (state().numParticles > 0 &&
+            (state().numParticles != numParticles || state().trailLength != trailLength)) {
+            resize(state().numParticles, state().trailLength);
+        }
         
         for (int i = 0; i < numParticles; i++) {
             particlePositions[i].write(state().currentParticles[i]);
@@ -160,7 +201,9 @@ struct MyApp : DistributedAppWithState<CommonState> {
 
         // g.shader().uniform("pointSize", state().pointSize / 100);
 
-        Mesh newMesh;
+        // reset keeps the capacity, so only the first frame allocates
+        Mesh &newMesh = trailMesh;
+        newMesh.reset();
         newMesh.primitive(Mesh::POINTS);
         for (int i = 0; i < numParticles; i++) {
             for (int j = 0; j < trailLength; j++) {
@@ -181,18 +224,20 @@ struct MyApp : DistributedAppWithState<CommonState> {
     }
 };
 
-int main() {
-    MyApp app;
-    app.start();
+int main(int argc, char* argv[]) {
+    RunConfig config(numParticles, trailLength);
+    if (!config.parse(argc, argv)) {
+        return 1;
+    }
+    config.clamp(maxParticles, maxTrailLength);
+    numParticles = config.particles;
+    trailLength = config.trailLength;
+
+    if (numParticles <= smallCapacity) {
+        MyApp<smallCapacity> app;
+        app.start();
+    } else {
+        MyApp<maxParticles> app;
+        app.start();
+    }
 }
-
-string slurp(string fileName) {
-  fstream file(fileName);
-  string returnValue = "";
-  while (file.good()) {
-    string line;
-    getline(file, line);
-    returnValue += line + "\n";
-  }
-  return returnValue;
-}
\ No newline at end of file
@@ -1,9 +1,20 @@
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
 #include "al/app/al_App.hpp"
 #include "al/math/al_Random.hpp"
 #include "al/app/al_GUIDomain.hpp"
 #include "al/types/al_Buffer.hpp"
 
+#include "frame-profiler.hpp"
+#include "headless-runner.hpp"
+#include "parallel-for.hpp"
+#include "run-config.hpp"
+#include "slurp.hpp"
+#include "trail-chunks.hpp"
+
 #include "al/app/al_DistributedApp.hpp"
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
@@ -11,17 +22,199 @@
 #define STB_PERLIN_IMPLEMENTATION
 #include "allolib/external/stb/stb/stb_perlin.h"
 
+// stb_perlin_noise3(x, y, z, 0, 0, 0) for n points given as separate x, y and
+// z arrays: a port of stb's scalar code using stb's own tables, so values
+// match it exactly. points go through in blocks of 8 so the floor and fade
+// math vectorizes, but the corner hashing and gradient lookups are table
+// gathers and stay scalar; the gain is mostly the per-call overhead and the
+// wrap handling stb does that this never needs. `--check` times both
+static const float perlinGradient[12][3] = {
+    { 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+    { 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+    { 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+};
+
+inline float perlinGrad(int corner, float x, float y, float z) {
+    const float* g = perlinGradient[stb__perlin_randtab_grad_idx[corner]];
+    return g[0]*x + g[1]*y + g[2]*z;
+}
+
+inline float perlinLerp(float a, float b, float t) {
+    return a + (b-a) * t;
+}
+
+void perlinNoise3(const float* x, const float* y, const float* z, float* out, int n) {
+    const int lanes = 8;
+    for (int start = 0; start < n; start += lanes) {
+        int count = std::min(lanes, n - start);
+        int px[lanes], py[lanes], pz[lanes];
+        float fx[lanes], fy[lanes], fz[lanes];
+        float u[lanes], v[lanes], w[lanes];
+
+        for (int k = 0; k < count; k++) {
+            float a = x[start+k], b = y[start+k], c = z[start+k];
+            px[k] = (int)a; px[k] -= a < px[k];
+            py[k] = (int)b; py[k] -= b < py[k];
+            pz[k] = (int)c; pz[k] -= c < pz[k];
+            fx[k] = a - px[k];
+            fy[k] = b - py[k];
+            fz[k] = c - pz[k];
+            u[k] = ((fx[k]*6-15)*fx[k] + 10) * fx[k] * fx[k] * fx[k];
+            v[k] = ((fy[k]*6-15)*fy[k] + 10) * fy[k] * fy[k] * fy[k];
+            w[k] = ((fz[k]*6-15)*fz[k] + 10) * fz[k] * fz[k] * fz[k];
+        }
+
+        for (int k = 0; k < count; k++) {
+            int x0 = px[k] & 255, x1 = (px[k]+1) & 255;
+            int y0 = py[k] & 255, y1 = (py[k]+1) & 255;
+            int z0 = pz[k] & 255, z1 = (pz[k]+1) & 255;
+            int r0 = stb__perlin_randtab[x0];
+            int r1 = stb__perlin_randtab[x1];
+            int r00 = stb__perlin_randtab[r0+y0];
+            int r01 = stb__perlin_randtab[r0+y1];
+            int r10 = stb__perlin_randtab[r1+y0];
+            int r11 = stb__perlin_randtab[r1+y1];
+
+            float a = fx[k], b = fy[k], c = fz[k];
+            float n00 = perlinLerp(perlinGrad(r00+z0, a, b, c), perlinGrad(r00+z1, a, b, c-1), w[k]);
+            float n01 = perlinLerp(perlinGrad(r01+z0, a, b-1, c), perlinGrad(r01+z1, a, b-1, c-1), w[k]);
+            float n10 = perlinLerp(perlinGrad(r10+z0, a-1, b, c), perlinGrad(r10+z1, a-1, b, c-1), w[k]);
+            float n11 = perlinLerp(perlinGrad(r11+z0, a-1, b-1, c), perlinGrad(r11+z1, a-1, b-1, c-1), w[k]);
+            out[start+k] = perlinLerp(perlinLerp(n00, n01, v[k]), perlinLerp(n10, n11, v[k]), u[k]);
+        }
+    }
+}
+
+// scratch arrays for one batch of noise lookups
+struct NoiseBatch {
+    std::vector<float> x, y, z, value;
+
+    void resize(int n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        value.resize(n);
+    }
+
+    void compute() {
+        perlinNoise3(x.data(), y.data(), z.data(), value.data(), x.size());
+    }
+};
+
+// noise cached on a size^3 grid over [-extent, extent] in x and y and a
+// window of z that follows a scrolling offset. z slices live in a ring, so
+// as the offset advances only the slices scrolling in get recomputed, and
+// lookups are trilinear reads instead of full noise evaluations
+struct NoiseLattice {
+    static const int size = 64;
+
+    float extent;
+    float spacing;
+    int zFirst = 0; // absolute index of the lowest slice held, at z = zFirst*spacing
+    bool built = false;
+    std::vector<float> values; // slice j is stored at ring index j mod size
+    NoiseBatch slice;
+
+    NoiseLattice(float e) : extent(e), spacing(2 * e / (size - 2)) {
+        values.resize(size * size * size);
+        slice.resize(size * size);
+    }
+
+    void computeSlice(int j) {
+        for (int b = 0; b < size; b++) {
+            for (int a = 0; a < size; a++) {
+                slice.x[b * size + a] = -extent + a * spacing;
+                slice.y[b * size + a] = -extent + b * spacing;
+                slice.z[b * size + a] = j * spacing;
+            }
+        }
+        slice.compute();
+        int ring = ((j % size) + size) % size;
+        std::copy(slice.value.begin(), slice.value.end(), values.begin() + ring * size * size);
+    }
+
+    // holds the slices covering z in [offset - extent, offset + extent]
+    void update(float offset) {
+        int wanted = (int)std::floor((offset - extent) / spacing);
+        if (!built || std::abs(wanted - zFirst) >= size) {
+            zFirst = wanted;
+            for (int j = zFirst; j < zFirst + size; j++) {
+                computeSlice(j);
+            }
+            built = true;
+        }
+        while (zFirst < wanted) {
+            computeSlice(zFirst + size);
+            zFirst++;
+        }
+        while (zFirst > wanted) {
+            zFirst--;
+            computeSlice(zFirst);
+        }
+    }
+
+    // fills batch.value[begin..end) from the lattice, falling back to the
+    // real noise for points outside it. read only, so ranges can be sampled
+    // from several threads at once
+    void sample(NoiseBatch& batch, int begin, int end) const {
+        for (int i = begin; i < end; i++) {
+            float gx = (batch.x[i] + extent) / spacing;
+            float gy = (batch.y[i] + extent) / spacing;
+            float gz = batch.z[i] / spacing - zFirst;
+            if (!(gx >= 0 && gx < size - 1 && gy >= 0 && gy < size - 1 && gz >= 0 && gz < size - 1)) {
+                batch.value[i] = stb_perlin_noise3(batch.x[i], batch.y[i], batch.z[i], 0, 0, 0);
+                continue;
+            }
+            int ix = (int)gx, iy = (int)gy, iz = (int)gz;
+            float tx = gx - ix, ty = gy - iy, tz = gz - iz;
+            const float* s0 = &values[(((zFirst + iz) % size + size) % size) * size * size];
+            const float* s1 = &values[(((zFirst + iz + 1) % size + size) % size) * size * size];
+            int c = iy * size + ix;
+            float a0 = perlinLerp(perlinLerp(s0[c], s0[c+1], tx), perlinLerp(s0[c+size], s0[c+size+1], tx), ty);
+            float a1 = perlinLerp(perlinLerp(s1[c], s1[c+1], tx), perlinLerp(s1[c+size], s1[c+size+1], tx), ty);
+            batch.value[i] = perlinLerp(a0, a1, tz);
+        }
+    }
+
+    void sample(NoiseBatch& batch) const {
+        sample(batch, 0, batch.x.size());
+    }
+};
+
+// uncomment to have every renderer run the particle update itself from the
+// parameters the primary sends, instead of receiving all the positions
+// #define LOCAL_SIMULATION
+
+// comment out to send positions as full floats, twice the bytes per frame of
+// the 16 bit encoding. has no effect under LOCAL_SIMULATION
+#define QUANTIZED_STATE
+
 using namespace al;
 using namespace std;
 
-static const int numParticles = 1500;
-static const int trailLength = 100;
+// capacities the distributed state is built for. the counts actually used
+// are picked at launch (see run-config.hpp), main runs the app with the
+// smallest capacity that holds them and renderers follow the state's size
+// header. Cuttlebone sends the whole state every frame however few particles
+// are in use, 6 bytes per particle of capacity quantized: 9 KB at 1500,
+// 120 KB at 20000, 300 KB at 50000 (twice that as floats). every node has to be started with the same counts
+// so they agree on the capacity, except under LOCAL_SIMULATION, where
+// positions aren't sent and the capacity only sizes local buffers
+static const int smallCapacity = 1500;
+static const int mediumCapacity = 20000;
+static const int maxParticles = 50000;
+static const int maxTrailLength = 1000;
+static int numParticles = 1500;
+static int trailLength = 100;
 static const float baseSpeed = 0.1;
 static const float speedBoost = 0.9;
 static const float rotationConst = 0.02;
 static const float noiseSize = 0.1;
 static const float chaosOffset = 0.015;
 static const float chaosMaxOffset = 0.1;
+// particles never leave this radius (max radius + noise, plus chaos), so
+// the broadcast state can store them as 16 bit fractions of it
+static const float stateRange = 4.0;
 
 Vec3f sphereToCar(float t, float p) {
     float x = sin(t) * cos(p);
@@ -30,35 +223,417 @@ Vec3f sphereToCar(float t, float p) {
     return Vec3f(x, y, z).normalized();
 }
 
+// rotation about the (t, p) axis by amt, built once per frame and applied to
+// every particle instead of rebuilding the matrix per point
+struct Rotation {
+    float m[9];
+
+    Rotation(float t, float p, float amt) {
+        Vec3f axis = sphereToCar(t, p);
+        float c = cos(amt);
+        float s = sin(amt);
+        float k = 1 - c;
+
+        m[0] = c + axis.x * axis.x * k;
+        m[1] = axis.x * axis.y * k - axis.z * s;
+        m[2] = axis.x * axis.z * k + axis.y * s;
+        m[3] = axis.y * axis.x * k + axis.z * s;
+        m[4] = c + axis.y * axis.y * k;
+        m[5] = axis.y * axis.z * k - axis.x * s;
+        m[6] = axis.z * axis.x * k - axis.y * s;
+        m[7] = axis.z * axis.y * k + axis.x * s;
+        m[8] = c + axis.z * axis.z * k;
+    }
+
+    Vec3f apply(Vec3f point) const {
+        return Vec3f(m[0] * point.x + m[1] * point.y + m[2] * point.z,
+                     m[3] * point.x + m[4] * point.y + m[5] * point.z,
+                     m[6] * point.x + m[7] * point.y + m[8] * point.z);
+    }
+
+    // rotates n packed points in place, written as a flat loop so the
+    // compiler can vectorize it. the matrix is copied to locals first: the
+    // stores through p could alias m as far as the compiler knows, which
+    // would make it reload m every iteration and keep the loop scalar
+    void apply(Vec3f* points, int n) const {
+        const float m0 = m[0], m1 = m[1], m2 = m[2];
+        const float m3 = m[3], m4 = m[4], m5 = m[5];
+        const float m6 = m[6], m7 = m[7], m8 = m[8];
+        float* p = points[0].elems();
+        for (int i = 0; i < n; i++) {
+            float x = p[3*i];
+            float y = p[3*i+1];
+            float z = p[3*i+2];
+            p[3*i]   = m0 * x + m1 * y + m2 * z;
+            p[3*i+1] = m3 * x + m4 * y + m5 * z;
+            p[3*i+2] = m6 * x + m7 * y + m8 * z;
+        }
+    }
+};
+
 Vec3f rotatePoint(Vec3f point, float t, float p, float amt) {
-    Vec3f axis = sphereToCar(t, p);
+    return Rotation(t, p, amt).apply(point);
+}
 
-    float r1 = cos(amt) + pow(axis.x, 2) * (1 - cos(amt));
-    float r2 = axis.x * axis.y * (1 - cos(amt)) - axis.z * sin(amt);
-    float r3 = axis.x * axis.z * (1 - cos(amt)) + axis.y * sin(amt);
-    float r4 = axis.y * axis.x * (1 - cos(amt)) + axis.z * sin(amt);
-    float r5 = cos(amt) + pow(axis.y, 2) * (1 - cos(amt));
-    float r6 = axis.y * axis.z * (1 - cos(amt)) - axis.x * sin(amt);
-    float r7 = axis.z * axis.x * (1 - cos(amt)) - axis.y * sin(amt);
-    float r8 = axis.z * axis.y * (1 - cos(amt)) + axis.x * sin(amt);
-    float r9 = cos(amt) + pow(axis.z, 2) * (1 - cos(amt));
+// all trails in one preallocated array, chunk by chunk: the particles of a
+// chunk (see trail-chunks.hpp) take trailLength consecutive slots, so a chunk
+// is one contiguous range to upload or draw. each frame the newest positions
+// of every particle overwrite the oldest slot in place
+struct TrailStore {
+    std::vector<Vec3f> points;
+    TrailChunks chunks;
+    int head = 0;
+    long long writes = 0; // counts write() calls, renderers compare against it
+    int version = 0;      // counts init() calls, a new layout needs new buffers
+
+    void init() {
+        chunks.resize(numParticles, trailLength);
+        points.assign(numParticles * trailLength, Vec3f(0));
+        head = 0;
+        version++;
+    }
+
+    int chunkFirst(int chunk) const {
+        return chunks.begin(chunk) * trailLength;
+    }
+
+    int chunkCount(int chunk) const {
+        return chunks.end(chunk) - chunks.begin(chunk);
+    }
+
+    // first point of the given slot of a chunk
+    int slotFirst(int chunk, int slot) const {
+        return chunkFirst(chunk) + slot * chunkCount(chunk);
+    }
+
+    void write(const Vec3f* positions) {
+        head = (head + 1) % trailLength;
+        for (int c = 0; c < chunks.numChunks; c++) {
+            std::copy(positions + chunks.begin(c), positions + chunks.end(c), points.begin() + slotFirst(c, head));
+        }
+        chunks.update(positions, head);
+        writes++;
+    }
+
+    // 0 for the oldest slot, trailLength-1 for the one just written
+    int age(int slot) const {
+        return (slot - head - 1 + 2 * trailLength) % trailLength;
+    }
+};
 
-    Vec3f newPoint = Vec3f(r1 * point.x + r2 * point.y + r3 * point.z,
-                           r4 * point.x + r5 * point.y + r6 * point.z,
-                           r7 * point.x + r8 * point.y + r9 * point.z);
+// the GL side of the trails: a position and a flicker noise buffer in the
+// TrailStore layout. a chunk that was up to date on the previous write only
+// uploads its newest slot, one that was out of view uploads all of it
+struct TrailBuffers {
+    GLuint vao = 0;
+    BufferObject positions;
+    BufferObject noise;
+    int version = -1; // the TrailStore layout the buffers are made for
+    std::vector<long long> uploaded;    // per chunk, the writes count its positions are at
+    std::vector<long long> noiseFrame;  // per chunk, the frame its noise was made for
 
-    return newPoint;
+    void init(const TrailStore& store) {
+        if (vao == 0) {
+            glGenVertexArrays(1, &vao);
+            positions.bufferType(GL_ARRAY_BUFFER);
+            positions.usage(GL_DYNAMIC_DRAW);
+            positions.create();
+            noise.bufferType(GL_ARRAY_BUFFER);
+            noise.usage(GL_DYNAMIC_DRAW);
+            noise.create();
+
+            glBindVertexArray(vao);
+            positions.bind();
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+            noise.bind();
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
+            glBindVertexArray(0);
+        }
+        positions.bind();
+        positions.data(sizeof(Vec3f) * store.points.size(), nullptr);
+        // zeros, not garbage: the shader reads the noise even with no flicker
+        std::vector<float> zeros(store.points.size(), 0.0f);
+        noise.bind();
+        noise.data(sizeof(float) * zeros.size(), zeros.data());
+        track(store);
+    }
+
+    // the bookkeeping half of init, nothing uploaded yet
+    void track(const TrailStore& store) {
+        version = store.version;
+        uploaded.assign(store.chunks.numChunks, -2);
+        noiseFrame.assign(store.chunks.numChunks, -1);
+    }
+
+    // the points of a chunk written since it last went up, marked as sent.
+    // false when it's up to date
+    bool takePending(const TrailStore& store, int chunk, int& first, int& count) {
+        if (uploaded[chunk] == store.writes) {
+            return false;
+        }
+        first = store.chunkFirst(chunk);
+        count = store.chunkCount(chunk) * trailLength;
+        if (uploaded[chunk] == store.writes - 1) {
+            first = store.slotFirst(chunk, store.head);
+            count = store.chunkCount(chunk);
+        }
+        uploaded[chunk] = store.writes;
+        return true;
+    }
+
+    void uploadPositions(const TrailStore& store, int chunk) {
+        int first, count;
+        if (!takePending(store, chunk, first, count)) {
+            return;
+        }
+        positions.bind();
+        positions.subdata(sizeof(Vec3f) * first, sizeof(Vec3f) * count, &store.points[first]);
+    }
+
+    void uploadNoise(int first, int count, const float* values) {
+        noise.bind();
+        noise.subdata(sizeof(float) * first, sizeof(float) * count, values + first);
+    }
+};
+
+// flicker noise at every point of a chunk, into the same indices of batch
+void sampleFlicker(const TrailStore& store, int chunk, float frameFlicker,
+                   const NoiseLattice& lattice, NoiseBatch& batch) {
+    int first = store.chunkFirst(chunk);
+    int count = store.chunkCount(chunk) * trailLength;
+    for (int i = first; i < first + count; i++) {
+        batch.x[i] = store.points[i].x;
+        batch.y[i] = store.points[i].y;
+        batch.z[i] = store.points[i].z+frameFlicker;
+    }
+    lattice.sample(batch, first, first + count);
+}
+
+// counter based random numbers: the same (seed, frame, index) gives the same
+// value on every machine, no matter who runs the update or in what order
+uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
 }
 
+float hashUniformS(uint32_t seed, uint32_t frame, uint32_t index, uint32_t draw) {
+    uint32_t h = hash32(seed + hash32(frame + hash32(index + hash32(draw))));
+    return (h >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+// same distribution as rnd::ball, by rejection
+Vec3f hashBall(uint32_t seed, uint32_t frame, uint32_t index) {
+    for (uint32_t draw = 0; ; draw += 3) {
+        Vec3f v(hashUniformS(seed, frame, index, draw),
+                hashUniformS(seed, frame, index, draw + 1),
+                hashUniformS(seed, frame, index, draw + 2));
+        if (v.magSqr() <= 1) {
+            return v;
+        }
+    }
+}
+
+// everything one particle update depends on
+struct SimParams {
+    uint32_t seed;
+    uint32_t frame;
+    float theta;
+    float phi;
+    float amount;
+    float radius;
+    float radiusIntens;
+    float frameRadius;
+    float chaos;
+    bool radiusByNoise;
+};
+
+static const int minParticlesPerThread = 4096;
+
+void initParticles(Vec3f* particles, uint32_t seed) {
+    for (int i = 0; i < numParticles; i++) {
+        particles[i] = hashBall(seed, 0, i);
+    }
+    // the trail chunks are index ranges, so start with neighbors in space
+    // next to each other in index. the rotation keeps them together, chaos
+    // slowly spreads them out again
+    mortonSort(particles, numParticles, 1);
+}
+
+// every particle depends only on itself and on hashBall(seed, frame, index),
+// so each pass splits the range across threads and the result is the same
+// for any thread count
+void stepParticles(Vec3f* particles, const SimParams& sim, NoiseBatch& noise, NoiseLattice& lattice) {
+    {
+        PROFILE_SCOPE("rotation");
+        Rotation rotation(sim.theta, sim.phi, sim.amount);
+        parallelFor(numParticles, minParticlesPerThread, [&](int begin, int end) {
+            rotation.apply(particles + begin, end - begin);
+        });
+    }
+
+    if (sim.radiusByNoise) {
+        PROFILE_SCOPE("noise");
+        noise.resize(numParticles);
+        lattice.update(sim.frameRadius);
+        parallelFor(numParticles, minParticlesPerThread, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                noise.x[i] = particles[i].x;
+                noise.y[i] = particles[i].y;
+                noise.z[i] = particles[i].z+sim.frameRadius;
+            }
+            lattice.sample(noise, begin, end);
+        });
+    }
+
+    PROFILE_SCOPE("jitter");
+    float noiseVal = sim.radiusIntens*stb_perlin_noise3(0, 0, sim.frameRadius, 0, 0, 0);
+    parallelFor(numParticles, minParticlesPerThread, [&](int begin, int end) {
+        float newRadius = sim.radius+noiseVal;
+        for (int i = begin; i < end; i++) {
+            Vec3f newPoint = particles[i];
+            if (sim.radiusByNoise) {
+                newRadius = sim.radius + sim.radiusIntens*noise.value[i];
+            }
+            newPoint += hashBall(sim.seed, sim.frame, i) * sim.chaos * chaosOffset;
+            float radiusUpper = newRadius*(1+sim.chaos*chaosMaxOffset);
+            float radiusLower = newRadius*(1-sim.chaos*chaosMaxOffset);
+            float mag = newPoint.mag();
+            if (mag > radiusUpper) {
+                newPoint *= radiusUpper / mag;
+            } else if (mag < radiusLower) {
+                newPoint *= radiusLower / mag;
+            }
+
+            particles[i] = newPoint;
+        }
+    });
+}
+
+// what LOCAL_SIMULATION renderers need to stay in step when Cuttlebone
+// drops states, which it does whenever a renderer falls behind: the
+// parameters of the last historyLength frames, so a renderer can replay the
+// frames it missed, and a rolling keyframe of keyframeSize exact positions
+// per frame cycling through the particles, which repairs a renderer that
+// missed more than the history holds, or joined late, within
+// numParticles / keyframeSize frames. about 4 KB a frame whatever the count
+struct SimSync {
+    static const int historyLength = 32;
+    static const int keyframeSize = 256;
+
+    SimParams history[historyLength]; // frame f is at f % historyLength
+    int keyframeFirst;                // positions of particles keyframeFirst.. after this frame
+    int keyframeCount;
+    Vec3f keyframe[keyframeSize];
+
+    // primary, once the frame in sim has been stepped
+    void record(const SimParams& sim, const Vec3f* particles) {
+        history[sim.frame % historyLength] = sim;
+        int slices = (numParticles + keyframeSize - 1) / keyframeSize;
+        keyframeFirst = sim.frame % slices * keyframeSize;
+        keyframeCount = std::min(keyframeSize, numParticles - keyframeFirst);
+        std::copy(particles + keyframeFirst, particles + keyframeFirst + keyframeCount, keyframe);
+    }
+};
+
+// a renderer's own copy of the simulation, following the primary's SimSync
+struct SimFollower {
+    uint32_t seed = 0;  // 0 restarts from the primary's seed
+    uint32_t frame = 0; // the frame the local particles were last stepped to
+
+    // brings particles to sim.frame, replaying every missed frame from the
+    // history, then takes this frame's keyframe, which only changes anything
+    // if the copy had drifted. false if the history didn't reach back far
+    // enough and the copy jumped ahead, to be repaired by the keyframes
+    bool follow(const SimParams& sim, const SimSync& sync, Vec3f* particles,
+                NoiseBatch& noise, NoiseLattice& lattice) {
+        bool inStep = true;
+        if (sim.seed != seed) {
+            seed = sim.seed;
+            initParticles(particles, seed);
+            frame = 0;
+        }
+        if (sim.frame - frame > (uint32_t)SimSync::historyLength) {
+            frame = sim.frame;
+            inStep = false;
+        }
+        while (frame != sim.frame) {
+            frame++;
+            stepParticles(particles, sync.history[frame % SimSync::historyLength], noise, lattice);
+        }
+        int end = std::min(sync.keyframeFirst + sync.keyframeCount, numParticles);
+        for (int i = sync.keyframeFirst; i < end; i++) {
+            particles[i] = sync.keyframe[i - sync.keyframeFirst];
+        }
+        return inStep;
+    }
+};
+
+short quantize(float v) {
+    v = std::max(-1.0f, std::min(1.0f, v / stateRange));
+    return (short)lround(v * 32767);
+}
+
+float dequantize(short q) {
+    return q * (stateRange / 32767.0f);
+}
+
+// a position as it goes out in the state, 16 bit fractions of stateRange
+struct QuantizedPosition {
+    short v[3];
+
+    QuantizedPosition& operator=(const Vec3f &p) {
+        for (int k = 0; k < 3; k++) {
+            v[k] = quantize(p[k]);
+        }
+        return *this;
+    }
+};
+
+Vec3f decode(const QuantizedPosition &q) {
+    return Vec3f(dequantize(q.v[0]), dequantize(q.v[1]), dequantize(q.v[2]));
+}
+
+Vec3f decode(const Vec3f &p) {
+    return p;
+}
+
+#ifdef QUANTIZED_STATE
+typedef QuantizedPosition StatePosition;
+#else
+typedef Vec3f StatePosition;
+#endif
+
+template <int Capacity, class Position = StatePosition>
 struct CommonState {
+    // size header: how much of the arrays below is in use
+    int numParticles;
+    int trailLength;
     Nav primaryNav;
-    Vec3f currentParticles[numParticles];
+    SimParams sim;
+#ifdef LOCAL_SIMULATION
+    SimSync sync;
+#else
+    Position currentParticles[Capacity];
+#endif
     float pointSize;
     float chaos;
     float flickerIntens;
 };
 
-struct MyApp : DistributedAppWithState<CommonState> {
+template <int Capacity>
+struct MyApp : DistributedAppWithState<CommonState<Capacity>> {
+    using DistributedAppWithState<CommonState<Capacity>>::state;
+    using DistributedAppWithState<CommonState<Capacity>>::isPrimary;
+    using DistributedAppWithState<CommonState<Capacity>>::nav;
+    using DistributedAppWithState<CommonState<Capacity>>::quit;
+    using DistributedAppWithState<CommonState<Capacity>>::defaultWindowDomain;
+
     Parameter theta{"theta", "", 0.0, -M_PI, M_PI};
     Parameter phi{"phi", "", 0.0, -M_PI/2.0, M_PI/2.0};
     Parameter pointSize{"pointSize", "", 4.0, 1.0, 8.0};
@@ -76,7 +651,34 @@ struct MyApp : DistributedAppWithState<CommonState> {
     Parameter orbitSpeed{"orbitSpeed", "", 0.005, -0.01, 0.01};
     ParameterBool lookAtCenter{"lookAtCenter", "", 0.0};
 
-    RingBuffer<Vec3f> particlePositions[numParticles];
+    // scoped timer breakdown, milliseconds per frame
+    ParameterBool profiling{"profiling", "", 0.0};
+    Parameter rotationMs{"rotation_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter noiseMs{"noise_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter jitterMs{"jitter_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter stateSyncMs{"stateSync_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter trailWriteMs{"trailWrite_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter uploadMs{"upload_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter flickerMs{"flicker_ms", "profile", 0.0, 0.0, 10.0};
+    Parameter drawMs{"draw_ms", "profile", 0.0, 0.0, 10.0};
+    prof::Breakdown breakdown;
+
+    // full precision positions: the primary simulates on these and only the
+    // encoded copy goes out, renderers rebuild them from the state
+    vector<Vec3f> particles = vector<Vec3f>(Capacity);
+    TrailStore trails;
+    TrailBuffers trailBuffers;
+    long long animateFrame = 0;
+    NoiseBatch radiusNoise;
+    NoiseBatch flickerNoise;
+    NoiseLattice radiusLattice{stateRange};
+    NoiseLattice flickerLattice{stateRange};
+
+    // colors trails from their age and flicker noise on the GPU
+    ShaderProgram trailShader;
+
+    // renderers under LOCAL_SIMULATION step their own copy
+    SimFollower follower;
 
     float frameFlicker = 0;
     float frameRadius = 0;
@@ -89,7 +691,7 @@ struct MyApp : DistributedAppWithState<CommonState> {
     
     void onInit() override {
         auto cuttleboneDomain =
-        CuttleboneStateSimulationDomain<CommonState>::enableCuttlebone(this);
+        CuttleboneStateSimulationDomain<CommonState<Capacity>>::enableCuttlebone(this);
         if (!cuttleboneDomain) {
             std::cerr << "ERROR: Could not start Cuttlebone. Quitting." << std::endl;
             quit();
@@ -113,26 +715,59 @@ struct MyApp : DistributedAppWithState<CommonState> {
             gui.add(orbitRadius);
             gui.add(orbitSpeed);
             gui.add(lookAtCenter);
+            gui.add(profiling);
+            gui.add(rotationMs);
+            gui.add(noiseMs);
+            gui.add(jitterMs);
+            gui.add(stateSyncMs);
+            gui.add(trailWriteMs);
+            gui.add(uploadMs);
+            gui.add(flickerMs);
+            gui.add(drawMs);
+            profiling.registerChangeCallback([](float on) { prof::enable(on); });
         }
     }
 
+    // renderers only; allocates, so it runs when the header changes and not
+    // every frame
+    void resize(int newNumParticles, int newTrailLength) {
+        numParticles = std::min(newNumParticles, Capacity);
+        trailLength = std::min(newTrailLength, maxTrailLength);
+        trails.init();
+        follower.seed = 0;  // a local simulation restarts from the primary's seed
+    }
+
     void onCreate() override {
         if (isPrimary()) {
-            for (int i = 0; i < numParticles; i++) {
-                Vec3f pos = rnd::ball<Vec3f>();
-                state().currentParticles[i] =  pos;
-            }
+            uint32_t seed = std::random_device()() | 1;
+            initParticles(particles.data(), seed);
+            state().numParticles = numParticles;
+            state().trailLength = trailLength;
+            state().sim.seed = seed;
+            state().sim.frame = 0;
 
             state().primaryNav.pos(0, 0, 4);
             state().primaryNav.faceToward(0,0,0);
         }
 
-        for (int i = 0; i < numParticles; i++) {
-            particlePositions[i].resize(trailLength);
-        }
+        trails.init();
+
+        breakdown.add("rotation", rotationMs);
+        breakdown.add("noise", noiseMs);
+        breakdown.add("jitter", jitterMs);
+        breakdown.add("state sync", stateSyncMs);
+        breakdown.add("trail write", trailWriteMs);
+        breakdown.add("upload", uploadMs);
+        breakdown.add("flicker", flickerMs);
+        breakdown.add("draw", drawMs);
+
+        trailShader.compile(slurp("../trail-vertex.glsl"),
+                            slurp("../trail-fragment.glsl"));
     }
 
     void onAnimate(double dt) override {
+        animateFrame++;
+
         if (isPrimary()) {
             if (!frozen) { 
                 float adjustedChaos = chaos*0.8+0.01;
@@ -141,27 +776,26 @@ struct MyApp : DistributedAppWithState<CommonState> {
                 phi = phi + adjustedChaos*rotationConst*0.25;
                 if (phi > M_PI/2.0) {phi = phi - M_PI;}
 
-                float amount = (baseSpeed + speedBoost*chaos) * dt;
-                float noiseVal = radiusIntens*stb_perlin_noise3(0, 0, frameRadius, 0, 0, 0);
-                float newRadius = radius+noiseVal;
+                SimParams &sim = state().sim;
+                sim.frame++;
+                sim.theta = theta;
+                sim.phi = phi;
+                sim.amount = (baseSpeed + speedBoost*chaos) * dt;
+                sim.radius = radius;
+                sim.radiusIntens = radiusIntens;
+                sim.frameRadius = frameRadius;
+                sim.chaos = chaos;
+                sim.radiusByNoise = radiusByNoise;
+                stepParticles(particles.data(), sim, radiusNoise, radiusLattice);
 
+                PROFILE_SCOPE("state sync");
+#ifdef LOCAL_SIMULATION
+                state().sync.record(sim, particles.data());
+#else
                 for (int i = 0; i < numParticles; i++) {
-                    Vec3f currentPoint = state().currentParticles[i];
-                    Vec3f newPoint = rotatePoint(currentPoint, theta, phi, amount);
-                    if (radiusByNoise) {
-                        newRadius = radius + radiusIntens*stb_perlin_noise3(newPoint.x, newPoint.y, newPoint.z+frameRadius, 0, 0, 0);
-                    }
-                    newPoint += rnd::ball<Vec3f>() * chaos * chaosOffset;
-                    float radiusUpper = newRadius*(1+chaos*chaosMaxOffset);
-                    float radiusLower = newRadius*(1-chaos*chaosMaxOffset);
-                    if (newPoint.mag() > radiusUpper) {
-                        newPoint.mag(radiusUpper);
-                    } else if (newPoint.mag() < radiusLower) {
-                        newPoint.mag(radiusLower);
-                    }
-
-                    state().currentParticles[i] = newPoint;
+                    state().currentParticles[i] = particles[i];
                 }
+#endif
             }
 
             if (orbitCircle || orbitTrans > 0 ) {
@@ -201,10 +835,31 @@ struct MyApp : DistributedAppWithState<CommonState> {
             }
         }
         
-        if (!frozen) {
+        if (!isPrimary()) {
+            // the primary picked its counts at launch, follow its size header
+            // before touching any particle
+            if (state().numParticles > 0 &&
+                (state().numParticles != numParticles || state().trailLength != trailLength)) {
+                resize(state().numParticles, state().trailLength);
+            }
+
+#ifdef LOCAL_SIMULATION
+            const SimParams &sim = state().sim;
+            bool starting = sim.seed != follower.seed;
+            uint32_t behind = sim.frame - follower.frame;
+            if (!follower.follow(sim, state().sync, particles.data(), radiusNoise, radiusLattice) && !starting) {
+                std::cerr << "fell " << behind << " frames behind the primary, resyncing from keyframes" << std::endl;
+            }
+#else
             for (int i = 0; i < numParticles; i++) {
-                particlePositions[i].write(state().currentParticles[i]);
+                particles[i] = decode(state().currentParticles[i]);
             }
+#endif
+        }
+
+        if (!frozen) {
+            PROFILE_SCOPE("trail write");
+            trails.write(particles.data());
         }
 
         if (!isPrimary()) {
@@ -218,22 +873,58 @@ struct MyApp : DistributedAppWithState<CommonState> {
             g.blendTrans();
             g.depthTesting(true);
             g.pointSize(state().pointSize);
-            g.meshColor();
+            g.shader(trailShader);
+            g.shader().uniform("chaos", state().chaos);
+            g.shader().uniform("flickerIntens", state().flickerIntens);
+            g.shader().uniform("trailLength", trailLength);
+            g.shader().uniform("head", trails.head);
+            g.update();
 
-            Mesh newMesh;
-            newMesh.primitive(Mesh::POINTS);
-            for (int i = 0; i < numParticles; i++) {
-                for (int j = 0; j < trailLength; j++) {
-                    int index = (particlePositions[i].pos()+j)%trailLength;
-                    Vec3f pos = particlePositions[i][index];
-                    newMesh.vertex(pos);
-                    float noiseVal = 1-state().flickerIntens*(0.5+stb_perlin_noise3(pos.x, pos.y, pos.z+frameFlicker, 0, 0, 0));
-                    Color c = Color(noiseVal*(0.8+state().chaos*0.2), noiseVal*(0.8-state().chaos*0.8), noiseVal*(1-state().chaos), j/(float)trailLength);
-                    newMesh.color(c);
+            if (trailBuffers.version != trails.version) {
+                trailBuffers.init(trails);
+            }
+
+            // only chunks that can be in this view go up and get drawn; with
+            // several views per frame each chunk still uploads once
+            Frustum frustum = Frustum::fromMatrix(g.projMatrix() * g.viewMatrix());
+            bool flicker = state().flickerIntens > 0;
+            if (flicker) {
+                flickerNoise.resize(trails.points.size());
+                flickerLattice.update(frameFlicker);
+            }
+
+            glBindVertexArray(trailBuffers.vao);
+            for (int c = 0; c < trails.chunks.numChunks; c++) {
+                if (!frustum.intersects(trails.chunks.bounds[c])) {
+                    continue;
+                }
+                int first = trails.chunkFirst(c);
+                int count = trails.chunkCount(c) * trailLength;
+
+                {
+                    PROFILE_SCOPE("upload");
+                    trailBuffers.uploadPositions(trails, c);
+                }
+
+                // only the flicker noise goes up with the positions, and only
+                // when there is flicker
+                if (flicker && trailBuffers.noiseFrame[c] != animateFrame) {
+                    PROFILE_SCOPE("flicker");
+                    sampleFlicker(trails, c, frameFlicker, flickerLattice, flickerNoise);
+                    trailBuffers.uploadNoise(first, count, flickerNoise.value.data());
+                    trailBuffers.noiseFrame[c] = animateFrame;
                 }
+
+                PROFILE_SCOPE("draw");
+                trailShader.uniform("chunkFirst", first);
+                trailShader.uniform("chunkCount", trails.chunkCount(c));
+                glDrawArrays(GL_POINTS, first, count);
             }
+            glBindVertexArray(0);
 
-            g.draw(newMesh);
+            if (isPrimary()) {
+                breakdown.update();
+            }
     }
 
     bool onKeyDown(Keyboard const& k) override {
@@ -243,11 +934,603 @@ struct MyApp : DistributedAppWithState<CommonState> {
         else if (k.key() == 'f') {
             frozen = !frozen;
         }
+        else if (k.key() == 't') {
+            // whatever the rings still hold, open in chrome://tracing or ui.perfetto.dev
+            prof::exportTrace("trace.json");
+        }
         return true;
     }
 };
 
-int main() {
-    MyApp app;
-    app.start();
-}
\ No newline at end of file
+// the parameters headless runs and the checks drive the update with in place
+// of the GUI: mid chaos, a steady rotation and the noise radius scrolling
+SimParams scriptedSim() {
+    return {1, 0, 0, 0, 0, 1.0, 0.5, 0, 0.5, true};
+}
+
+void advanceScriptedSim(SimParams& sim, double dt) {
+    sim.frame++;
+    sim.theta += (sim.chaos*0.8+0.01)*rotationConst;
+    sim.phi += (sim.chaos*0.8+0.01)*rotationConst*0.25;
+    sim.amount = (baseSpeed + speedBoost*sim.chaos) * dt;
+    sim.frameRadius += 0.004;
+}
+
+// clip space test for one point, the reference the frustum cull is held to
+bool insideClip(const Mat4f& m, const Vec3f& p) {
+    float c[4];
+    for (int r = 0; r < 4; r++) {
+        c[r] = m(r, 0) * p.x + m(r, 1) * p.y + m(r, 2) * p.z + m(r, 3);
+    }
+    return c[3] > 0 && fabs(c[0]) <= c[3] && fabs(c[1]) <= c[3] && fabs(c[2]) <= c[3];
+}
+
+// the trail chunks against brute force on a million trail points: a random
+// walk fills every slot, then every stored point has to be inside its
+// chunk's sphere and no chunk holding a point inside the frustum may be
+// culled. also times update() and the cull
+void checkTrailChunks(CheckResults& check) {
+    const int n = 10000;
+    const int length = 100;
+    mt19937 rng(1);
+    uniform_real_distribution<float> uniform(-1, 1);
+    vector<Vec3f> points(n);
+    vector<Vec3f> history(n * length);
+    for (auto &p : points) {
+        do {
+            p = Vec3f(uniform(rng), uniform(rng), uniform(rng));
+        } while (p.magSqr() > 1);
+    }
+    mortonSort(points.data(), n, 1);
+    TrailChunks chunks;
+    chunks.resize(n, length);
+    int frame = 0;
+    runHeadless("trail chunk update", n * length, 2 * length, 1 / 60.0, [&](double) {
+        chunks.update(points.data(), frame++ % length);
+    });
+
+    for (int f = 0; f < 2 * length; f++) {
+        for (auto &p : points) {
+            p += Vec3f(uniform(rng), uniform(rng), uniform(rng)) * 0.01f;
+        }
+        int slot = f % length;
+        copy(points.begin(), points.end(), history.begin() + slot * n);
+        chunks.update(points.data(), slot);
+    }
+    int outside = 0;
+    for (int c = 0; c < chunks.numChunks; c++) {
+        const BoundingSphere& b = chunks.bounds[c];
+        for (int s = 0; s < length; s++) {
+            for (int i = chunks.begin(c); i < chunks.end(c); i++) {
+                outside += (history[s * n + i] - b.center).mag() > b.radius * 1.0001f + 1e-6f;
+            }
+        }
+    }
+    check.expect(outside == 0, "trail chunks: %d of %d trail points outside their chunk's sphere",
+                 outside, n * length);
+
+    // a 0.6 rad perspective camera close enough that part of the cloud is off
+    // screen
+    Mat4f projection, view;
+    float focal = 1 / tan(0.3f);
+    projection(0, 0) = focal / 1.5f;
+    projection(1, 1) = focal;
+    projection(2, 2) = (100 + 0.1f) / (0.1f - 100);
+    projection(2, 3) = 2 * 100 * 0.1f / (0.1f - 100);
+    projection(3, 2) = -1;
+    for (int i = 0; i < 4; i++) {
+        view(i, i) = 1;
+    }
+    view(0, 3) = 1.2f;
+    view(2, 3) = -1.2f;
+    Mat4f viewProjection = projection * view;
+    Frustum frustum = Frustum::fromMatrix(viewProjection);
+
+    int visible = 0, wronglyCulled = 0;
+    for (int c = 0; c < chunks.numChunks; c++) {
+        bool seen = false;
+        for (int s = 0; s < length && !seen; s++) {
+            for (int i = chunks.begin(c); i < chunks.end(c) && !seen; i++) {
+                seen = insideClip(viewProjection, history[s * n + i]);
+            }
+        }
+        bool kept = frustum.intersects(chunks.bounds[c]);
+        visible += kept;
+        wronglyCulled += seen && !kept;
+    }
+    check.expect(wronglyCulled == 0, "trail chunks: %d chunks with a visible point culled, %d of %d kept",
+                 wronglyCulled, visible, chunks.numChunks);
+    check.expect(!frustum.intersects({Vec3f(0, 0, 5), 0.5f}), "trail chunks: a sphere behind the camera is culled");
+
+    runHeadless("trail chunk cull", chunks.numChunks, 100, 1 / 60.0, [&](double) {
+        visible = 0;
+        for (const BoundingSphere& b : chunks.bounds) {
+            visible += frustum.intersects(b);
+        }
+    });
+}
+
+// the per-point Rodrigues rotation the sphere started with, rebuilding the
+// matrix for every point, kept as the reference Rotation is checked against
+Vec3f rotatePointReference(Vec3f point, float t, float p, float amt) {
+    Vec3f axis = sphereToCar(t, p);
+
+    float r1 = cos(amt) + pow(axis.x, 2) * (1 - cos(amt));
+    float r2 = axis.x * axis.y * (1 - cos(amt)) - axis.z * sin(amt);
+    float r3 = axis.x * axis.z * (1 - cos(amt)) + axis.y * sin(amt);
+    float r4 = axis.y * axis.x * (1 - cos(amt)) + axis.z * sin(amt);
+    float r5 = cos(amt) + pow(axis.y, 2) * (1 - cos(amt));
+    float r6 = axis.y * axis.z * (1 - cos(amt)) - axis.x * sin(amt);
+    float r7 = axis.z * axis.x * (1 - cos(amt)) - axis.y * sin(amt);
+    float r8 = axis.z * axis.y * (1 - cos(amt)) + axis.x * sin(amt);
+    float r9 = cos(amt) + pow(axis.z, 2) * (1 - cos(amt));
+
+    return Vec3f(r1 * point.x + r2 * point.y + r3 * point.z,
+                 r4 * point.x + r5 * point.y + r6 * point.z,
+                 r7 * point.x + r8 * point.y + r9 * point.z);
+}
+
+// Rotation::apply over a batch against the reference, point by point, over
+// a spread of axes and angles. the two only differ in rounding
+void checkRotation(CheckResults& check) {
+    const int n = 100000;
+    vector<Vec3f> points(n), rotated(n);
+    for (int i = 0; i < n; i++) {
+        points[i] = hashBall(7, 0, i);
+    }
+    float worst = 0;
+    for (int k = 0; k < 16; k++) {
+        float t = -M_PI + 2 * M_PI * k / 16;
+        float p = 0.37f * k;
+        float amt = (k % 2 ? -1 : 1) * 0.01f * (k + 1);
+        rotated = points;
+        Rotation(t, p, amt).apply(rotated.data(), n);
+        for (int i = 0; i < n; i++) {
+            worst = max(worst, (rotated[i] - rotatePointReference(points[i], t, p, amt)).mag());
+        }
+    }
+    check.expect(worst < 1e-5f, "rotation: batch vs per-point Rodrigues, worst error %g", worst);
+
+    rotated = points;
+    runHeadless("rotation", n, 100, 1 / 60.0, [&](double) {
+        Rotation(0.3f, 1.1f, 0.01f).apply(rotated.data(), n);
+    });
+}
+
+// perlinNoise3 against stb_perlin_noise3 point by point, then both timed on
+// the same points
+void checkPerlinBatch(CheckResults& check) {
+    const int n = 100000;
+    NoiseBatch batch;
+    batch.resize(n);
+    for (int i = 0; i < n; i++) {
+        batch.x[i] = stateRange * hashUniformS(3, 0, i, 0);
+        batch.y[i] = stateRange * hashUniformS(3, 0, i, 1);
+        batch.z[i] = stateRange * hashUniformS(3, 0, i, 2);
+    }
+    batch.compute();
+    float worst = 0;
+    for (int i = 0; i < n; i++) {
+        worst = max(worst, fabs(batch.value[i] - stb_perlin_noise3(batch.x[i], batch.y[i], batch.z[i], 0, 0, 0)));
+    }
+    check.expect(worst < 1e-6f, "perlin: batch vs stb_perlin_noise3, worst difference %g", worst);
+
+    runHeadless("perlin batch", n, 50, 1 / 60.0, [&](double) {
+        batch.compute();
+    });
+    runHeadless("perlin stb", n, 50, 1 / 60.0, [&](double) {
+        for (int i = 0; i < n; i++) {
+            batch.value[i] = stb_perlin_noise3(batch.x[i], batch.y[i], batch.z[i], 0, 0, 0);
+        }
+    });
+}
+
+// the noise lattice against the exact noise it caches, at particle positions
+// on a few scroll offsets, and a lattice that scrolled into place against one
+// built there directly: the slices only depend on their index, so the two
+// have to agree bit for bit, as they do on every node
+void checkNoiseLattice(CheckResults& check) {
+    const int n = 100000;
+    NoiseBatch batch;
+    batch.resize(n);
+    NoiseLattice scrolled{stateRange};
+    const float offsets[] = {0, 0.05f, 0.37f, 1.9f, 12.5f, 3.0f};
+    float worst = 0;
+    double errorSqr = 0, signalSqr = 0;
+    bool identical = true;
+    for (float offset : offsets) {
+        for (int i = 0; i < n; i++) {
+            Vec3f p = hashBall(5, 0, i) * 1.3f;
+            batch.x[i] = p.x;
+            batch.y[i] = p.y;
+            batch.z[i] = p.z + offset;
+        }
+        scrolled.update(offset);
+        scrolled.sample(batch);
+        vector<float> values = batch.value;
+        for (int i = 0; i < n; i++) {
+            float exact = stb_perlin_noise3(batch.x[i], batch.y[i], batch.z[i], 0, 0, 0);
+            worst = max(worst, fabs(values[i] - exact));
+            errorSqr += (values[i] - exact) * (values[i] - exact);
+            signalSqr += exact * exact;
+        }
+        NoiseLattice fresh{stateRange};
+        fresh.update(offset);
+        fresh.sample(batch);
+        identical = identical && values == batch.value;
+    }
+    int samples = n * sizeof(offsets) / sizeof(offsets[0]);
+    check.expect(worst < 0.08f, "noise lattice: vs stb_perlin_noise3, worst error %g, rms %g against signal rms %g",
+                 worst, sqrt(errorSqr / samples), sqrt(signalSqr / samples));
+    check.expect(identical, "noise lattice: scrolled and freshly built lattices sample the same");
+
+    NoiseLattice lattice{stateRange};
+    float offset = 0;
+    runHeadless("noise lattice", n, 100, 1 / 60.0, [&](double) {
+        offset += 0.004f;
+        lattice.update(offset);
+        lattice.sample(batch);
+    });
+}
+
+// stepParticles with the pool at several sizes, every run from the same seed
+// and parameters: each pass splits by index and a particle only depends on
+// itself, so the positions have to come out bit for bit the same
+void checkThreadIndependence(CheckResults& check) {
+    const int counts[] = {1, 2, 3, 7, 16};
+    int savedParticles = numParticles;
+    int savedThreads = threadCount();
+    numParticles = 100000;
+    vector<Vec3f> reference;
+    bool identical = true;
+    for (int threads : counts) {
+        setThreadCount(threads);
+        vector<Vec3f> particles(numParticles);
+        NoiseBatch noise;
+        NoiseLattice lattice{stateRange};
+        SimParams sim = scriptedSim();
+        initParticles(particles.data(), sim.seed);
+        for (int frame = 0; frame < 30; frame++) {
+            advanceScriptedSim(sim, 1 / 60.0);
+            stepParticles(particles.data(), sim, noise, lattice);
+        }
+        if (reference.empty()) {
+            reference = particles;
+        }
+        identical = identical && memcmp(reference.data(), particles.data(), numParticles * sizeof(Vec3f)) == 0;
+    }
+    setThreadCount(savedThreads);
+    numParticles = savedParticles;
+    check.expect(identical, "step: 100k particles after 30 frames identical on 1, 2, 3, 7 and 16 threads");
+}
+
+// two renderers following one primary under LOCAL_SIMULATION: one sees
+// every state, the other misses a few frames, then more than the history
+// holds. the first has to match the primary bit for bit every frame, the
+// second right after replaying its short gap, and again once a keyframe
+// cycle after the long one has gone by
+void checkLocalSimulation(CheckResults& check) {
+    int savedParticles = numParticles;
+    numParticles = 5000;
+    vector<Vec3f> primary(numParticles), every(numParticles), dropping(numParticles);
+    NoiseBatch primaryNoise, everyNoise, droppingNoise;
+    NoiseLattice primaryLattice{stateRange}, everyLattice{stateRange}, droppingLattice{stateRange};
+    SimSync sync;
+    SimFollower everyFollower, droppingFollower;
+    SimParams sim = scriptedSim();
+    initParticles(primary.data(), sim.seed);
+    auto same = [](const vector<Vec3f>& a, const vector<Vec3f>& b) {
+        return memcmp(a.data(), b.data(), a.size() * sizeof(Vec3f)) == 0;
+    };
+
+    int slices = (numParticles + SimSync::keyframeSize - 1) / SimSync::keyframeSize;
+    int longGapEnd = 60 + SimSync::historyLength + 10;
+    bool everyInStep = true, replayed = false, drifted = false, repaired = false;
+    int jumps = 0;
+    for (int frame = 1; frame <= longGapEnd + slices; frame++) {
+        advanceScriptedSim(sim, 1 / 60.0);
+        stepParticles(primary.data(), sim, primaryNoise, primaryLattice);
+        sync.record(sim, primary.data());
+
+        everyFollower.follow(sim, sync, every.data(), everyNoise, everyLattice);
+        everyInStep = everyInStep && same(every, primary);
+
+        bool dropped = (frame >= 10 && frame < 15) || (frame >= 60 && frame < longGapEnd);
+        if (!dropped) {
+            jumps += !droppingFollower.follow(sim, sync, dropping.data(), droppingNoise, droppingLattice);
+            if (frame == 15) replayed = same(dropping, primary);
+            if (frame == longGapEnd) drifted = !same(dropping, primary);
+        }
+    }
+    repaired = same(dropping, primary);
+    numParticles = savedParticles;
+
+    check.expect(everyInStep, "local simulation: a renderer seeing every state matches the primary every frame");
+    check.expect(replayed, "local simulation: replaying 5 missed frames from the history matches the primary");
+    check.expect(jumps == 1 && drifted && repaired,
+                 "local simulation: after missing %d frames it jumps ahead and %d keyframes bring it back",
+                 longGapEnd - 60, slices);
+}
+
+// positions of frames frames of the scripted run, for the trail checks
+vector<vector<Vec3f>> scriptedFrames(int frames) {
+    vector<vector<Vec3f>> out(frames, vector<Vec3f>(numParticles));
+    vector<Vec3f> particles(numParticles);
+    NoiseBatch noise;
+    NoiseLattice lattice{stateRange};
+    SimParams sim = scriptedSim();
+    initParticles(particles.data(), sim.seed);
+    for (int frame = 0; frame < frames; frame++) {
+        advanceScriptedSim(sim, 1 / 60.0);
+        stepParticles(particles.data(), sim, noise, lattice);
+        out[frame] = particles;
+    }
+    return out;
+}
+
+// TrailStore::write at the default 1500 particles and 100 frame trails,
+// against the per-particle RingBuffers it replaced. after a full lap every
+// slot has to hold the frame its age says
+void checkTrailWrite(CheckResults& check) {
+    int savedParticles = numParticles, savedLength = trailLength;
+    numParticles = 1500;
+    trailLength = 100;
+    vector<vector<Vec3f>> frames = scriptedFrames(trailLength);
+
+    TrailStore trails;
+    trails.init();
+    int frame = 0;
+    FrameTimings store = runHeadless("trail write", numParticles * trailLength, 2 * trailLength, 1 / 60.0, [&](double) {
+        trails.write(frames[frame++ % trailLength].data());
+    });
+    vector<RingBuffer<Vec3f>> rings(numParticles);
+    for (auto& ring : rings) {
+        ring.resize(trailLength);
+    }
+    frame = 0;
+    FrameTimings ringBuffers = runHeadless("trail write RingBuffer", numParticles * trailLength, 2 * trailLength, 1 / 60.0, [&](double) {
+        const vector<Vec3f>& positions = frames[frame++ % trailLength];
+        for (int i = 0; i < numParticles; i++) {
+            rings[i].write(positions[i]);
+        }
+    });
+
+    int misplaced = 0;
+    for (int c = 0; c < trails.chunks.numChunks; c++) {
+        for (int slot = 0; slot < trailLength; slot++) {
+            const Vec3f* points = &trails.points[trails.slotFirst(c, slot)];
+            const vector<Vec3f>& written = frames[trails.age(slot)];
+            for (int i = trails.chunks.begin(c); i < trails.chunks.end(c); i++) {
+                misplaced += points[i - trails.chunks.begin(c)] != written[i];
+            }
+        }
+    }
+    numParticles = savedParticles;
+    trailLength = savedLength;
+    check.expect(misplaced == 0, "trail write: 1500 x 100, %d points misplaced, %.3f ms vs %.3f ms per-particle RingBuffers",
+                 misplaced, store.median(), ringBuffers.median());
+}
+
+// one frame of trails at 1500 x 100, every chunk in view, with and without
+// flicker: what goes up to the GPU and what the CPU spends getting it
+// there, against the Mesh with a position and Color per trail point that
+// onDraw used to rebuild, which went up whole every frame
+void checkTrailUpload(CheckResults& check) {
+    int savedParticles = numParticles, savedLength = trailLength;
+    numParticles = 1500;
+    trailLength = 100;
+    vector<vector<Vec3f>> frames = scriptedFrames(trailLength);
+    int points = numParticles * trailLength;
+
+    for (bool flicker : {false, true}) {
+        TrailStore trails;
+        trails.init();
+        TrailBuffers buffers;
+        buffers.track(trails);
+        NoiseBatch flickerNoise;
+        flickerNoise.resize(points);
+        NoiseLattice flickerLattice{stateRange};
+        float frameFlicker = 0;
+        int frame = 0;
+        long long bytes = 0;
+        auto trailFrame = [&](double) {
+            trails.write(frames[frame++ % trailLength].data());
+            if (flicker) {
+                frameFlicker += 0.03f;
+                flickerLattice.update(frameFlicker);
+            }
+            for (int c = 0; c < trails.chunks.numChunks; c++) {
+                int first, count;
+                if (buffers.takePending(trails, c, first, count)) {
+                    bytes += sizeof(Vec3f) * count;
+                }
+                if (flicker) {
+                    sampleFlicker(trails, c, frameFlicker, flickerLattice, flickerNoise);
+                    bytes += sizeof(float) * trails.chunkCount(c) * trailLength;
+                }
+            }
+        };
+        // the first frame sends every chunk whole
+        trailFrame(0);
+        bytes = 0;
+        FrameTimings store = runHeadless(flicker ? "trail frame flicker" : "trail frame", points, trailLength, 1 / 60.0, trailFrame);
+        long long storeBytes = bytes / trailLength;
+
+        vector<RingBuffer<Vec3f>> rings(numParticles);
+        for (auto& ring : rings) {
+            ring.resize(trailLength);
+        }
+        float flickerIntens = flicker ? 0.5f : 0.0f, chaos = 0.5f;
+        frame = 0;
+        frameFlicker = 0;
+        bytes = 0;
+        FrameTimings mesh = runHeadless(flicker ? "trail frame flicker Color mesh" : "trail frame Color mesh", points, trailLength, 1 / 60.0, [&](double) {
+            const vector<Vec3f>& positions = frames[frame++ % trailLength];
+            for (int i = 0; i < numParticles; i++) {
+                rings[i].write(positions[i]);
+            }
+            frameFlicker += 0.03f;
+            Mesh newMesh;
+            newMesh.primitive(Mesh::POINTS);
+            for (int i = 0; i < numParticles; i++) {
+                for (int j = 0; j < trailLength; j++) {
+                    Vec3f pos = rings[i][(rings[i].pos()+j)%trailLength];
+                    newMesh.vertex(pos);
+                    float noiseVal = 1-flickerIntens*(0.5+stb_perlin_noise3(pos.x, pos.y, pos.z+frameFlicker, 0, 0, 0));
+                    newMesh.color(Color(noiseVal*(0.8+chaos*0.2), noiseVal*(0.8-chaos*0.8), noiseVal*(1-chaos), j/(float)trailLength));
+                }
+            }
+            bytes += newMesh.vertices().size() * (sizeof(Vec3f) + sizeof(Color));
+        });
+        long long meshBytes = bytes / trailLength;
+
+        check.expect(storeBytes < meshBytes && store.median() < mesh.median(),
+                     "trail frame%s: %lld bytes, %.3f ms vs %lld bytes, %.3f ms for the Color mesh",
+                     flicker ? " with flicker" : "", storeBytes, store.median(), meshBytes, mesh.median());
+    }
+    numParticles = savedParticles;
+    trailLength = savedLength;
+}
+
+// the state encoding at one capacity: what each frame costs with 16 bit and
+// float positions, and the worst error of a 30 frame run sent through the
+// quantized encoding and back. rounding puts a coordinate at most half a step
+// off, fail past a whole step of stateRange/32767
+template <int Capacity>
+void checkQuantization(CheckResults& check) {
+    int savedParticles = numParticles;
+    numParticles = Capacity;
+    vector<Vec3f> particles(numParticles);
+    NoiseBatch noise;
+    NoiseLattice lattice{stateRange};
+    SimParams sim = scriptedSim();
+    initParticles(particles.data(), sim.seed);
+    for (int frame = 0; frame < 30; frame++) {
+        advanceScriptedSim(sim, 1 / 60.0);
+        stepParticles(particles.data(), sim, noise, lattice);
+    }
+
+    vector<QuantizedPosition> sent(numParticles);
+    vector<char> wire(numParticles * sizeof(QuantizedPosition));
+    vector<QuantizedPosition> received(numParticles);
+    vector<Vec3f> decoded(numParticles);
+    FrameTimings timings = runHeadless("quantize loopback", numParticles, 30, 1 / 60.0, [&](double) {
+        for (int i = 0; i < numParticles; i++) {
+            sent[i] = particles[i];
+        }
+        memcpy(wire.data(), sent.data(), wire.size());
+        memcpy(received.data(), wire.data(), wire.size());
+        for (int i = 0; i < numParticles; i++) {
+            decoded[i] = decode(received[i]);
+        }
+    });
+    float worst = 0;
+    for (int i = 0; i < numParticles; i++) {
+        for (int k = 0; k < 3; k++) {
+            worst = std::max(worst, std::abs(decoded[i][k] - particles[i][k]));
+        }
+    }
+    numParticles = savedParticles;
+
+    float step = stateRange / 32767.0f;
+    check.expect(worst <= step,
+                 "quantize: %d particles, state %zu bytes quantized vs %zu as floats, "
+                 "worst error %.2e (limit %.2e), %.2f ms encode and decode",
+                 Capacity, sizeof(CommonState<Capacity, QuantizedPosition>),
+                 sizeof(CommonState<Capacity, Vec3f>), worst, step, timings.median());
+}
+
+// what an empty PROFILE_SCOPE costs with profiling off, where it's left in
+// every hot path, and on. then Breakdown::update with profiling off and
+// nothing recorded has to leave the GUI parameters alone
+void checkProfilerOverhead(CheckResults& check) {
+    const int n = 100000;
+    bool wasEnabled = prof::enabled();
+    double ns[2];
+    for (int on = 0; on < 2; on++) {
+        prof::enable(on);
+        FrameTimings timings = runHeadless(on ? "empty scopes on" : "empty scopes off", n, 50, 1 / 60.0, [&](double) {
+            for (int i = 0; i < n; i++) {
+                PROFILE_SCOPE("empty");
+            }
+        });
+        ns[on] = timings.median() * 1e6 / n;
+    }
+
+    prof::enable(false);
+    prof::Breakdown breakdown;
+    Parameter emptyMs{"empty_ms", "profile", 0.0, 0.0, 10.0};
+    breakdown.add("empty", emptyMs);
+    breakdown.update();
+    emptyMs.set(1.0);
+    breakdown.update();
+    prof::enable(wasEnabled);
+    check.expect(emptyMs.get() == 1.0f && ns[0] < ns[1],
+                 "profiler: empty scope %.1f ns off, %.1f ns on, idle update leaves the breakdown at %g",
+                 ns[0], ns[1], (float)emptyMs.get());
+}
+
+// `--check`: every fast path against a plain reference version
+int runChecks() {
+    CheckResults check;
+    checkQuantization<smallCapacity>(check);
+    checkQuantization<maxParticles>(check);
+    checkQuantization<500000>(check);
+    checkRotation(check);
+    checkPerlinBatch(check);
+    checkNoiseLattice(check);
+    checkThreadIndependence(check);
+    checkLocalSimulation(check);
+    checkTrailChunks(check);
+    checkTrailWrite(check);
+    checkTrailUpload(check);
+    checkProfilerOverhead(check);
+    return check.exitCode();
+}
+
+int main(int argc, char* argv[]) {
+    parseThreads(argc, argv);
+    RunConfig config(numParticles, trailLength);
+    if (!config.parse(argc, argv)) {
+        return 1;
+    }
+    config.clamp(maxParticles, maxTrailLength);
+    numParticles = config.particles;
+    trailLength = config.trailLength;
+
+    HeadlessOptions headless = parseHeadless(argc, argv);
+    if (headless.check) {
+        return runChecks();
+    }
+    if (headless.frames > 0) {
+        // the primary's particle update alone, at mid chaos with the noise
+        // radius on, for each size asked for, e.g. the scaling sweep
+        // `--headless 300 1500,20000,50000,200000`. there's no state to fit,
+        // so any size goes
+        prof::enable(headless.profile);
+        for (int size : headless.sizesOr(numParticles)) {
+            numParticles = size;
+            vector<Vec3f> particles(numParticles);
+            NoiseBatch noise;
+            NoiseLattice lattice{stateRange};
+            SimParams sim = scriptedSim();
+            initParticles(particles.data(), sim.seed);
+            runHeadless("sphere", numParticles, headless.frames, 1 / 60.0, [&](double dt) {
+                advanceScriptedSim(sim, dt);
+                stepParticles(particles.data(), sim, noise, lattice);
+            });
+        }
+        return 0;
+    }
+
+    if (numParticles <= smallCapacity) {
+        MyApp<smallCapacity> app;
+        app.start();
+    } else if (numParticles <= mediumCapacity) {
+        MyApp<mediumCapacity> app;
+        app.start();
+    } else {
+        MyApp<maxParticles> app;
+        app.start();
+    }
+}
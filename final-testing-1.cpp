@@ -3,8 +3,16 @@
 #include "al/math/al_Random.hpp"
 #include "al/graphics/al_Shapes.hpp"
 
+#include "headless-runner.hpp"
+#include "instanced-mesh.hpp"
+
+#include <cstring>
+
 struct MyApp : public al::App {
-    al::Mesh mesh;
+    // every octahedron is drawn in one call; the instances are only sent to
+    // the GPU again when the anchors change
+    InstancedMesh octahedra;
+    bool instancesChanged = true;
 
     const int numX = 20;
     const int numY = 20;
@@ -14,10 +22,9 @@ struct MyApp : public al::App {
 
     std::vector<al::Vec3f> anchors;
 
-
     void onCreate() {
-        addOctahedron(mesh);
-        mesh.generateNormals();
+        addOctahedron(octahedra.mesh);
+        octahedra.init("../instance-vertex.glsl", "../instance-fragment.glsl");
 
         int count = 0;
         for (int i = 0; i < numX; i++) {
@@ -31,32 +38,134 @@ struct MyApp : public al::App {
                 }
             }
         }
+        updateInstances();
 
         nav().pos(0, 0, 8);
         nav().faceToward(0,0,0);
     }
 
+    // call after changing anchors
+    void updateInstances() {
+        octahedra.instances.resize(anchors.size());
+        packInstances(anchors.data(), anchors.size(), size, al::Color(0.5, 0, 1), octahedra.instances.data());
+        instancesChanged = true;
+    }
+
     void onAnimate(double dt) {
 
     }
 
     void onDraw(al::Graphics& g) {
         g.depthTesting(true);
-        g.lighting(true);
         g.clear(1);
 
-        for (int i = 0; i < anchors.size(); i++) {
-            g.color(0.5, 0, 1);
-            g.pushMatrix();
-            g.translate(anchors[i]);
-            g.scale(size);
-            g.draw(mesh);
-            g.popMatrix();
+        octahedra.draw(g, instancesChanged);
+        instancesChanged = false;
+    }
+};
+
+// what submitting n octahedra costs the CPU each frame, both ways, without a
+// GL context. instanced: pack every instance and copy the buffer once, as
+// buffer.data does on upload. matrix stack, the way this sketch drew before:
+// per octahedron pushMatrix, translate, scale, popMatrix, and the model-view
+// product plus projection and color that g.draw sends as uniforms ahead of
+// its own draw call. the driver's per-call cost isn't in either, so the real
+// gap is wider than this
+struct SubmissionCost {
+    std::vector<al::Vec3f> anchors;
+    std::vector<Instance> instances;
+    std::vector<char> uploaded; // stands in for the buffer or uniform storage
+    al::Mat4f view;
+    float size = 0.3;
+
+    SubmissionCost(int n) : anchors(n), instances(n) {
+        for (auto& a : anchors) {
+            a = al::Vec3f(al::rnd::uniformS(), al::rnd::uniformS(), al::rnd::uniformS()) * 12;
+        }
+        view = affine(al::Vec3f(0, 0, -8), 1);
+    }
+
+    static al::Mat4f affine(al::Vec3f translate, float scale) {
+        al::Mat4f m;
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                m(r, c) = r == c ? (r == 3 ? 1 : scale) : 0;
+            }
+            if (r < 3) {
+                m(r, 3) = translate[r];
+            }
+        }
+        return m;
+    }
+
+    int instancedBytes() const { return sizeof(Instance) * anchors.size(); }
+    int matrixStackBytes() const { return (2 * sizeof(al::Mat4f) + sizeof(al::Color)) * anchors.size(); }
+
+    void instanced() {
+        packInstances(anchors.data(), anchors.size(), size, al::Color(0.5, 0, 1), instances.data());
+        uploaded.resize(instancedBytes());
+        std::memcpy(uploaded.data(), instances.data(), uploaded.size());
+    }
+
+    void matrixStack() {
+        al::Mat4f stack[2];
+        stack[0] = affine(al::Vec3f(0), 1);
+        al::Mat4f projection = affine(al::Vec3f(0), 1);
+        al::Color color(0.5, 0, 1);
+        uploaded.resize(matrixStackBytes());
+        char* out = uploaded.data();
+        for (const al::Vec3f& a : anchors) {
+            stack[1] = stack[0];
+            stack[1] = stack[1] * affine(a, 1);
+            stack[1] = stack[1] * affine(al::Vec3f(0), size);
+            al::Mat4f modelView = view * stack[1];
+            std::memcpy(out, &modelView, sizeof(modelView));
+            std::memcpy(out + sizeof(modelView), &projection, sizeof(projection));
+            std::memcpy(out + 2 * sizeof(modelView), &color, sizeof(color));
+            out += 2 * sizeof(modelView) + sizeof(color);
         }
     }
 };
 
-int main() {
+// `--check`: the instanced submission has to beat the matrix stack at every
+// size, with the bytes and draw calls each sends per frame
+int runChecks() {
+    CheckResults check;
+    for (int n : {8000, 64000, 512000}) {
+        SubmissionCost cost(n);
+        FrameTimings instanced = runHeadless("instanced submit", n, 30, 1 / 60.0, [&](double) {
+            cost.instanced();
+        });
+        FrameTimings matrixStack = runHeadless("matrix stack submit", n, 30, 1 / 60.0, [&](double) {
+            cost.matrixStack();
+        });
+        check.expect(instanced.median() < matrixStack.median(),
+                     "submit %d octahedra: instanced %.3f ms, %d bytes, 1 draw call; "
+                     "matrix stack %.3f ms, %d bytes, %d draw calls",
+                     n, instanced.median(), cost.instancedBytes(),
+                     matrixStack.median(), cost.matrixStackBytes(), n);
+    }
+    return check.exitCode();
+}
+
+int main(int argc, char* argv[]) {
+    HeadlessOptions headless = parseHeadless(argc, argv);
+    if (headless.check) {
+        return runChecks();
+    }
+    if (headless.frames > 0) {
+        for (int n : headless.sizesOr({8000, 64000, 512000})) {
+            SubmissionCost cost(n);
+            runHeadless("instanced submit", n, headless.frames, 1 / 60.0, [&](double) {
+                cost.instanced();
+            });
+            runHeadless("matrix stack submit", n, headless.frames, 1 / 60.0, [&](double) {
+                cost.matrixStack();
+            });
+        }
+        return 0;
+    }
+
     MyApp app;
     app.configureAudio(48000, 512, 2, 0);
     app.start();
@@ -2,35 +2,44 @@
 #include "al/app/al_App.hpp"
 #include "al/math/al_Random.hpp"
 
+#include "headless-runner.hpp"
+#include "trail-ring.hpp"
+
 using namespace al;
 
 static const int numParticles = 50;
 static const int trailLength = 30;
 
 struct Particle {
-    Vec3f pos[trailLength];
     Nav nav;
 
-    void update(float dt) { 
-        for (int i = trailLength-1; i > 0; i--) {
-            pos[i] = Vec3f(pos[i-1]);
-        }
-        pos[0] = nav.pos();
-    }
-
     void set(Vec3f initial) {
-        for (int i = 0; i < trailLength; i++) {
-            pos[i] = initial;
-        }
         nav.pos() = initial;
     }
 };
 
+// moves every particle one step and records the positions as the trails'
+// newest slot
+void stepParticles(Particle* particles, TrailRing& trails) {
+    Vec3f* newest = trails.advance();
+    for (int i = 0; i < numParticles; i++) {
+        Particle& p = particles[i];
+        if (dist(p.nav.pos(), Vec3f(0)) > 1) {
+            p.nav.faceToward(Vec3f(0), 1);
+        }
+
+        p.nav.moveF(0.01);
+        p.nav.step();
+
+        newest[i] = p.nav.pos();
+    }
+}
+
 struct MyApp : public App {
 
     Particle particles[numParticles];
 
-    Mesh particleMesh[trailLength+1];
+    TrailRing trails;
 
     float phase = 0;
 
@@ -39,6 +48,13 @@ struct MyApp : public App {
             p.set(rnd::ball<Vec3f>());
             p.nav.faceToward(rnd::ball<Vec3f>(), 1);
         }
+        trails.init(numParticles, trailLength, "../ring-vertex.glsl", "../trail-fragment.glsl");
+        for (int i = 0; i < trailLength; i++) {
+            Vec3f* slot = trails.advance();
+            for (int j = 0; j < numParticles; j++) {
+                slot[j] = particles[j].nav.pos();
+            }
+        }
 
         nav().pos(0, 0, 4);
         nav().faceToward(0,0,0);
@@ -47,45 +63,37 @@ struct MyApp : public App {
 
     void onAnimate(double dt) {
         phase += 0.1*dt;
-
-        for (Mesh& m : particleMesh) {
-            m.reset();
-            m.primitive(Mesh::POINTS);
-        }
-
-        for (auto& p : particles) {
-            p.update(dt);
-            if (dist(p.nav.pos(), Vec3f(0)) > 1) {
-                p.nav.faceToward(Vec3f(0), 1);
-            }
-
-            p.nav.moveF(0.01);
-            p.nav.step();
-
-            for (int i = 0; i < trailLength; i++) {
-                // particleMesh.vertex(p.pos[i]);
-                // particleMesh.color(RGB(1));
-                particleMesh[i+1].vertex(p.pos[i]);
-                particleMesh[i+1].color(RGB(1));
-            }
-            particleMesh[0].vertex(p.nav.pos());
-            particleMesh[0].color(RGB(1));
-        }
+        stepParticles(particles, trails);
     }
 
     void onDraw(Graphics& g) {
         g.clear();
         g.depthTesting(true);
         g.pointSize(8);
-        g.meshColor();
-        for (int i = 0; i < trailLength; i++) {
-            g.tint(1-i/(float)(trailLength-1));
-            g.draw(particleMesh[i]);
-        }
+        trails.draw(g);
     }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+    HeadlessOptions headless = parseHeadless(argc, argv);
+    if (headless.frames > 0) {
+        // the trail update at each trail length, sized by trail length: the
+        // ring recycles one slot per frame, so the time shouldn't grow with it
+        for (int length : headless.sizesOr({30, 300, 3000})) {
+            Particle particles[numParticles];
+            for (auto& p : particles) {
+                p.set(rnd::ball<Vec3f>());
+                p.nav.faceToward(rnd::ball<Vec3f>(), 1);
+            }
+            TrailRing trails;
+            trails.resize(numParticles, length);
+            runHeadless("trail ring", length, headless.frames, 1 / 60.0, [&](double) {
+                stepParticles(particles, trails);
+            });
+        }
+        return 0;
+    }
+
     MyApp app;
     app.start();
 }
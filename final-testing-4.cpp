@@ -3,6 +3,8 @@
 #include "al/math/al_Random.hpp"
 #include "al/app/al_GUIDomain.hpp"
 
+#include "trail-ring.hpp"
+
 using namespace al;
 
 static const int numParticles = 1500;
@@ -38,20 +40,9 @@ Vec3f sphereToCar(float t, float p) {
 }
 
 struct Particle {
-    Vec3f trail[trailLength];
     Nav nav;
 
-    void updateTrail() { 
-        for (int i = trailLength-1; i > 0; i--) {
-            trail[i] = Vec3f(trail[i-1]);
-        }
-        trail[0] = nav.pos();
-    }
-
     void set(Vec3f initial) {
-        for (int i = 0; i < trailLength; i++) {
-            trail[i] = initial;
-        }
         nav.pos() = initial;
     }
 
@@ -66,7 +57,7 @@ struct MyApp : public App {
 
     Particle particles[numParticles];
 
-    Mesh particleMesh[trailLength+1];
+    TrailRing trails;
 
     void onInit() override {
         auto GUIdomain = GUIDomain::enableGUI(defaultWindowDomain());
@@ -79,6 +70,13 @@ struct MyApp : public App {
         for (auto& p : particles) {
             p.set(rnd::ball<Vec3f>());
         }
+        trails.init(numParticles, trailLength, "../ring-vertex.glsl", "../trail-fragment.glsl");
+        for (int i = 0; i < trailLength; i++) {
+            Vec3f* slot = trails.advance();
+            for (int j = 0; j < numParticles; j++) {
+                slot[j] = particles[j].nav.pos();
+            }
+        }
 
         nav().pos(0, 0, 4);
         nav().faceToward(0,0,0);
@@ -86,26 +84,15 @@ struct MyApp : public App {
     }
 
     void onAnimate(double dt) override {
-        for (Mesh& m : particleMesh) {
-            m.reset();
-            m.primitive(Mesh::POINTS);
-        }
-
-
         float amount = 0.5 * dt;
 
-        for (auto& p : particles) {
-            p.updateTrail();
-
+        Vec3f* newest = trails.advance();
+        for (int i = 0; i < numParticles; i++) {
+            Particle& p = particles[i];
             Vec3f newPoint = rotatePoint(p.nav.pos(), theta, phi, amount);
             p.moveTo(newPoint);
 
-            particleMesh[0].vertex(p.nav.pos());
-            particleMesh[0].color(RGB(1));
-            for (int i = 0; i < trailLength; i++) {
-                particleMesh[i+1].vertex(p.trail[i]);
-                particleMesh[i+1].color(RGB(1));
-            }
+            newest[i] = p.nav.pos();
         }
     }
 
@@ -113,11 +100,7 @@ struct MyApp : public App {
         g.clear();
         g.depthTesting(true);
         g.pointSize(pointSize);
-        g.meshColor();
-        for (int i = 0; i < trailLength; i++) {
-            g.tint(1-i/(float)(trailLength-1));
-            g.draw(particleMesh[i]);
-        }
+        trails.draw(g);
     }
 };
 
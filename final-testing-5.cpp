@@ -8,10 +8,24 @@
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
-using namespace al;
+#include "run-config.hpp"
+
+#include <vector>
 
-static const int numParticles = 1500;
-static const int trailLength = 30;
+using namespace al;
+using namespace std;
+
+// capacities the distributed state is built for. the counts actually used
+// are picked at launch (see run-config.hpp), main runs the app with the
+// smallest capacity that holds them and renderers follow the state's size
+// header. Cuttlebone sends the whole state every frame however few particles
+// are in use, 12 bytes per particle of capacity: 18 KB at 1500, 240 KB at
+// 20000, so every node has to be started with the same counts to agree on it
+static const int smallCapacity = 1500;
+static const int maxParticles = 20000;
+static const int maxTrailLength = 1000;
+static int numParticles = 1500;
+static int trailLength = 30;
 static const float baseSpeed = 0.3;
 static const float speedBoost = 0.7;
 
@@ -42,23 +56,35 @@ Vec3f rotatePoint(Vec3f point, float t, float p, float amt) {
     return newPoint;
 }
 
+template <int Capacity>
 struct CommonState {
-    Vec3f currentParticles[numParticles];
+    // size header: how much of currentParticles is in use
+    int numParticles;
+    int trailLength;
+    Vec3f currentParticles[Capacity];
     Nav primaryNav;
 };
 
-struct MyApp : DistributedAppWithState<CommonState> {
+template <int Capacity>
+struct MyApp : DistributedAppWithState<CommonState<Capacity>> {
+    using DistributedAppWithState<CommonState<Capacity>>::state;
+    using DistributedAppWithState<CommonState<Capacity>>::isPrimary;
+    using DistributedAppWithState<CommonState<Capacity>>::nav;
+    using DistributedAppWithState<CommonState<Capacity>>::quit;
+    using DistributedAppWithState<CommonState<Capacity>>::defaultWindowDomain;
+
     Parameter theta{"theta", "", 0, -M_PI, M_PI};
     Parameter phi{"phi", "", 0.0, -M_PI, M_PI};
     Parameter pointSize{"pointSize", "", 4.0, 1.0, 10.0};
     Parameter chaos{"chaos", "", 0.0, 0.0, 1.0};
 
-    RingBuffer<Vec3f> particlePositions[numParticles];
-    Vec3f particleDirections[numParticles];
+    vector<RingBuffer<Vec3f>> particlePositions;
+    vector<Vec3f> particleDirections;
+    Mesh trailMesh;
 
     void onInit() override {
         auto cuttleboneDomain =
-        CuttleboneStateSimulationDomain<CommonState>::enableCuttlebone(this);
+        CuttleboneStateSimulationDomain<CommonState<Capacity>>::enableCuttlebone(this);
         if (!cuttleboneDomain) {
             std::cerr << "ERROR: Could not start Cuttlebone. Quitting." << std::endl;
             quit();
@@ -73,8 +99,23 @@ struct MyApp : DistributedAppWithState<CommonState> {
         }
     }
 
+    // sizes the per-particle buffers; allocates, so it only runs at startup
+    // and when a renderer sees a new size header
+    void resize(int newNumParticles, int newTrailLength) {
+        numParticles = min(newNumParticles, Capacity);
+        trailLength = min(newTrailLength, maxTrailLength);
+        particlePositions.resize(numParticles);
+        particleDirections.resize(numParticles);
+        for (int i = 0; i < numParticles; i++) {
+            particlePositions[i].resize(trailLength);
+            particleDirections[i] = Vec3f(1, 0, 0);
+        }
+    }
+
     void onCreate() override {
         if (isPrimary()) {
+            state().numParticles = numParticles;
+            state().trailLength = trailLength;
             for (int i = 0; i < numParticles; i++) {
                 Vec3f pos = rnd::ball<Vec3f>();
                 state().currentParticles[i] =  pos;
@@ -84,10 +125,7 @@ struct MyApp : DistributedAppWithState<CommonState> {
             state().primaryNav.faceToward(0,0,0);
         }
 
-        for (int i = 0; i < numParticles; i++) {
-            particlePositions[i].resize(trailLength);
-            particleDirections[i] = Vec3f(1, 0, 0);
-        }
+        resize(numParticles, trailLength);
     }
 
     void onAnimate(double dt) override {
@@ -103,6 +141,11 @@ struct MyApp : DistributedAppWithState<CommonState> {
     }
 
     void onDraw(Graphics& g) override {
+        if (state().numParticles > 0 &&
+            (state().numParticles != numParticles || state().trailLength != trailLength)) {
+            resize(state().numParticles, state().trailLength);
+        }
+
         for (int i = 0; i < numParticles; i++) {
             particlePositions[i].write(state().currentParticles[i]);
         }
@@ -114,7 +157,9 @@ struct MyApp : DistributedAppWithState<CommonState> {
         g.pointSize(pointSize);
         g.meshColor();
 
-        Mesh newMesh;
+        // reset keeps the capacity, so only the first frame allocates
+        Mesh &newMesh = trailMesh;
+        newMesh.reset();
         newMesh.primitive(Mesh::POINTS);
         for (int i = 0; i < numParticles; i++) {
             for (int j = 0; j < trailLength; j++) {
@@ -127,7 +172,20 @@ struct MyApp : DistributedAppWithState<CommonState> {
     }
 };
 
-int main() {
-    MyApp app;
-    app.start();
+int main(int argc, char* argv[]) {
+    RunConfig config(numParticles, trailLength);
+    if (!config.parse(argc, argv)) {
+        return 1;
+    }
+    config.clamp(maxParticles, maxTrailLength);
+    numParticles = config.particles;
+    trailLength = config.trailLength;
+
+    if (numParticles <= smallCapacity) {
+        MyApp<smallCapacity> app;
+        app.start();
+    } else {
+        MyApp<maxParticles> app;
+        app.start();
+    }
 }
\ No newline at end of file
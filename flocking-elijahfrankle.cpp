@@ -5,17 +5,117 @@
 #include "al/math/al_Random.hpp"
 #include "al/graphics/al_Shapes.hpp" // addCone
 
-struct MyApp : public al::App {
-    al::Mesh mesh;
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+
+#include "headless-runner.hpp"
+#include "instanced-mesh.hpp"
+#include "parallel-for.hpp"
+
+// structure-of-arrays copy of the agents' state from the start of the step.
+// the steering pass reads neighbors only from here and writes only to the
+// Navs, so every prey sees the same frame whatever thread or order it runs in
+struct BoidState {
+    std::vector<float> x, y, z;
+    std::vector<float> fx, fy, fz; // unit forward vector
+
+    void capture(const al::Nav* agents, int n) {
+        x.resize(n); y.resize(n); z.resize(n);
+        fx.resize(n); fy.resize(n); fz.resize(n);
+        for (int i = 0; i < n; i++) {
+            x[i] = agents[i].pos().x;
+            y[i] = agents[i].pos().y;
+            z[i] = agents[i].pos().z;
+            fx[i] = agents[i].uf().x;
+            fy[i] = agents[i].uf().y;
+            fz[i] = agents[i].uf().z;
+        }
+    }
 
-    const bool rotateCamera = false;
-    float phase = 0.0;
-    const float rotSpeed = 0.007;
-    const float cameraRadius = 13.0;
+    int size() const { return x.size(); }
+    al::Vec3d pos(int i) const { return al::Vec3d(x[i], y[i], z[i]); }
+    al::Vec3d uf(int i) const { return al::Vec3d(fx[i], fy[i], fz[i]); }
+};
+
+// uniform grid of cubic cells hashed into a table, rebuilt every step so
+// neighbor queries only look at agents in nearby cells instead of all of them
+struct SpatialGrid {
+    float cellSize;
+    int tableSize = 0;
+    std::vector<int> cellStart; // items of bucket b are items[cellStart[b]..cellStart[b+1])
+    std::vector<int> items;
+    std::vector<int> cellX, cellY, cellZ;
+    std::vector<int> fill;
+
+    SpatialGrid(float size) : cellSize(size) {}
+
+    int cellOf(double v) const { return (int)std::floor(v / cellSize); }
+
+    int bucket(int x, int y, int z) const {
+        unsigned h = (unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u;
+        return h & (tableSize - 1);
+    }
+
+    void build(const BoidState &agents) {
+        int n = agents.size();
+        tableSize = 1;
+        while (tableSize < 2 * n) tableSize *= 2;
+        cellStart.assign(tableSize + 1, 0);
+        items.resize(n);
+        cellX.resize(n);
+        cellY.resize(n);
+        cellZ.resize(n);
+
+        // counting sort of agent indices by bucket
+        for (int i = 0; i < n; i++) {
+            cellX[i] = cellOf(agents.x[i]);
+            cellY[i] = cellOf(agents.y[i]);
+            cellZ[i] = cellOf(agents.z[i]);
+            cellStart[bucket(cellX[i], cellY[i], cellZ[i]) + 1]++;
+        }
+        for (int b = 0; b < tableSize; b++) {
+            cellStart[b + 1] += cellStart[b];
+        }
+        fill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < n; i++) {
+            items[fill[bucket(cellX[i], cellY[i], cellZ[i])]++] = i;
+        }
+    }
 
-    static const int numPrey = 200;
+    // calls f(j) for every agent in a cell overlapping the cube of half-size r
+    // around p; callers still do their own distance test
+    template <class F>
+    void query(al::Vec3d p, float r, F f) const {
+        int x0 = cellOf(p.x - r), x1 = cellOf(p.x + r);
+        int y0 = cellOf(p.y - r), y1 = cellOf(p.y + r);
+        int z0 = cellOf(p.z - r), z1 = cellOf(p.z + r);
+        for (int x = x0; x <= x1; x++) {
+            for (int y = y0; y <= y1; y++) {
+                for (int z = z0; z <= z1; z++) {
+                    int b = bucket(x, y, z);
+                    for (int k = cellStart[b]; k < cellStart[b + 1]; k++) {
+                        int j = items[k];
+                        // skip agents from other cells that share this bucket
+                        if (cellX[j] == x && cellY[j] == y && cellZ[j] == z) {
+                            f(j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+// the whole simulation, no window or GL needed: the app steps it and draws
+// it, the headless runner only steps it
+struct Flock {
+    int numPrey;
     static const int numPredator = 3;
     static const int numFood = 4;
+    static const int minPreyPerThread = 256; // the default 200 steer serially
 
     const float radius = 3.0;
 
@@ -37,106 +137,133 @@ struct MyApp : public al::App {
     const float predatorSeperation = 0.04;
     const float predatorTightness = 0.4;
 
-    al::Nav prey[numPrey];
+    std::vector<al::Nav> prey;
     al::Nav predator[numPredator];
     al::Vec3d food[numFood];
 
-    void faceAway(al::Nav &object, al::Vec3d point, double amt=1) {
-        al::Vec3d oppositePoint = object.pos() * 2 - point;
-        object.faceToward(oppositePoint, amt);
-    }
+    BoidState preyState;
+    BoidState predatorState;
+    SpatialGrid preyGrid{neighborhood};
+    SpatialGrid predatorGrid{vision};
 
-    void onCreate() {
-        addCone(mesh);
-        mesh.generateNormals();
+    // placement and food respawns come from here, so a seed replays a run.
+    // left out, the seed is drawn from al::rnd as the positions used to be
+    std::mt19937 rng;
 
+    Flock(int n = 200, uint32_t seed = al::rnd::uniform() * 16777216.0f) : numPrey(n), prey(n), rng(seed) {
         for (int i = 0; i < numPrey; i++) {
-            prey[i].pos(al::rnd::ball<al::Vec3d>() * radius);
+            prey[i].pos(ball() * radius);
         }
         for (int i = 0; i < numPredator; i++) {
-            predator[i].pos(al::rnd::ball<al::Vec3d>() * radius);
+            predator[i].pos(ball() * radius);
         }
         for (int i = 0; i < numFood; i++) {
-            food[i] = al::rnd::ball<al::Vec3d>() * radius * 0.9;
+            food[i] = ball() * radius * 0.9;
         }
+    }
 
-        nav().pos(0, 0, cameraRadius);
-        nav().faceToward(0,0,0);
+    // uniform in the unit ball, by rejection like al::rnd::ball
+    al::Vec3d ball() {
+        std::uniform_real_distribution<double> uniform(-1, 1);
+        al::Vec3d v;
+        do {
+            v = al::Vec3d(uniform(rng), uniform(rng), uniform(rng));
+        } while (v.magSqr() > 1);
+        return v;
     }
 
-    void onAnimate(double dt) {
-        for (int i = 0; i < numFood; i++) {
-            for (int j = 0; j < numPrey; j++) {
-                if (al::dist(food[i], prey[j].pos()) <= 0.07) {
-                    food[i] = al::rnd::ball<al::Vec3d>() * radius * 0.9;
-                    break;
-                }
-            }
-        }
+    void faceAway(al::Nav &object, al::Vec3d point, double amt=1) {
+        al::Vec3d oppositePoint = object.pos() * 2 - point;
+        object.faceToward(oppositePoint, amt);
+    }
 
-        for (int i = 0; i < numPrey; i++) {
-            std::vector<al::Nav> preyInRange;
-            for (int j = 0; j < numPrey; j++) {
-                if (i != j) {
-                    if (al::dist(prey[i].pos(), prey[j].pos()) <= neighborhood) {
-                        preyInRange.push_back(prey[j]);
-                    }
+    // turns prey i; reads other agents only from the start-of-step state
+    void steerPrey(int i) {
+        // running sums over the neighbors, nothing is collected
+        al::Vec3d avgPreyPos = al::Vec3d(0);
+        al::Vec3d avgUF = al::Vec3d(0);
+        int preyInRange = 0;
+        preyGrid.query(prey[i].pos(), neighborhood, [&](int j) {
+            if (i != j) {
+                if (al::dist(prey[i].pos(), preyState.pos(j)) <= neighborhood) {
+                    avgPreyPos += preyState.pos(j);
+                    avgUF += preyState.uf(j);
+                    preyInRange++;
                 }
             }
+        });
+        if (preyInRange > 0) {
+            avgPreyPos /= (float)preyInRange;
+            avgUF /= (float)preyInRange;
+        }
 
-            std::vector<al::Nav> predatorInRange;
-            for (int j = 0; j < numPredator; j++) {
-                if (al::dist(prey[i].pos(), predator[j].pos()) <= vision) {
-                    predatorInRange.push_back(predator[j]);
-                }
+        al::Vec3d avgPredatorPos = al::Vec3d(0);
+        int predatorInRange = 0;
+        predatorGrid.query(prey[i].pos(), vision, [&](int j) {
+            if (al::dist(prey[i].pos(), predatorState.pos(j)) <= vision) {
+                avgPredatorPos += predatorState.pos(j);
+                predatorInRange++;
             }
+        });
+        if (predatorInRange > 0) {
+            avgPredatorPos /= (float)predatorInRange;
+        }
 
-            al::Vec3d avgPreyPos = al::Vec3d(0);
-            al::Vec3d avgUF = al::Vec3d(0);
-            for (int j = 0; j < preyInRange.size(); j++) {
-                avgPreyPos += preyInRange[j].pos()/(float)preyInRange.size();
-                avgUF += preyInRange[j].uf()/(float)preyInRange.size();
+        al::Vec3d closestFood = food[0];
+        for (int j = 1; j < numFood; j++) {
+            if (al::dist(prey[i].pos(), food[j]) < al::dist(prey[i].pos(), closestFood)) {
+                closestFood = food[j];
             }
+        }
 
-            al::Vec3d avgPredatorPos = al::Vec3d(0);
-            for (int j = 0; j < predatorInRange.size(); j++) {
-                avgPredatorPos += predatorInRange[j].pos()/(float)predatorInRange.size();
+        // cohesion + seperation
+        if (preyInRange > 0) {
+            if (al::dist(prey[i].pos(), avgPreyPos) < tightness) {
+                faceAway(prey[i], avgPreyPos, preySeperation);
+            } else if (al::dist(prey[i].pos(), avgPreyPos) > tightness+hysteresis) {
+                prey[i].faceToward(avgPreyPos, preyCohesion);
             }
+        }
 
-            al::Vec3d closestFood = food[0];
-            for (int j = 1; j < numFood; j++) {
-                if (al::dist(prey[i].pos(), food[j]) < al::dist(prey[i].pos(), closestFood)) {
-                    closestFood = food[j];
-                }
-            }
+        // alignment
+        if (preyInRange > 0) {
+            prey[i].faceToward(prey[i].pos()+avgUF.normalized(), preyAlignment);
+        }
 
-            // cohesion + seperation
-            if (preyInRange.size() > 0) {
-                if (al::dist(prey[i].pos(), avgPreyPos) < tightness) {
-                    faceAway(prey[i], avgPreyPos, preySeperation);
-                } else if (al::dist(prey[i].pos(), avgPreyPos) > tightness+hysteresis) {
-                    prey[i].faceToward(avgPreyPos, preyCohesion);
-                }
-            }
+        // hunger
+        prey[i].faceToward(closestFood, preyHunger);
 
-            // alignment
-            if (preyInRange.size() > 0) {
-                prey[i].faceToward(prey[i].pos()+avgUF.normalized(), preyAlignment);
-            }
+        //fear
+        if (predatorInRange > 0) {
+            faceAway(prey[i], avgPredatorPos, preyFear);
+        }
 
-            // hunger
-            prey[i].faceToward(closestFood, preyHunger);
+        // stay in radius
+        if (al::dist(prey[i].pos(), al::Vec3d(0)) > radius) {
+            prey[i].faceToward(al::Vec3d(0), bounding);
+        }
+    }
 
-            //fear
-            if (predatorInRange.size() > 0) {
-                faceAway(prey[i], avgPredatorPos, preyFear);
+    void step() {
+        for (int i = 0; i < numFood; i++) {
+            for (int j = 0; j < numPrey; j++) {
+                if (al::dist(food[i], prey[j].pos()) <= 0.07) {
+                    food[i] = ball() * radius * 0.9;
+                    break;
+                }
             }
+        }
 
-            // stay in radius
-            if (al::dist(prey[i].pos(), al::Vec3d(0)) > radius) {
-                prey[i].faceToward(al::Vec3d(0), bounding);
+        preyState.capture(prey.data(), numPrey);
+        predatorState.capture(predator, numPredator);
+        preyGrid.build(preyState);
+        predatorGrid.build(predatorState);
+
+        parallelFor(numPrey, minPreyPerThread, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                steerPrey(i);
             }
-        }
+        });
 
         for (int i = 0; i < numPredator; i++) {
             al::Vec3d preyPos = al::Vec3d(0);
@@ -176,13 +303,35 @@ struct MyApp : public al::App {
         for (int i = 0; i < numPredator; i++) {
             predator[i].step();
         }
+    }
+};
+
+struct MyApp : public al::App {
+    InstancedMesh cones;
+    Flock flock;
+
+    const bool rotateCamera = false;
+    float phase = 0.0;
+    const float rotSpeed = 0.007;
+    const float cameraRadius = 13.0;
+
+    void onCreate() {
+        addCone(cones.mesh);
+        cones.init("../instance-vertex.glsl", "../instance-fragment.glsl");
+
+        nav().pos(0, 0, cameraRadius);
+        nav().faceToward(0,0,0);
+    }
+
+    void onAnimate(double dt) {
+        flock.step();
 
         al::Vec3d avgPosition;
-        for (int i = 0; i < numPrey; i++) {
-            avgPosition += prey[i].pos()/(float)numPrey;
+        for (int i = 0; i < flock.numPrey; i++) {
+            avgPosition += flock.prey[i].pos()/(float)flock.numPrey;
         }
-        for (int i = 0; i < numPredator; i++) {
-            avgPosition += predator[i].pos()/(float)numPredator;
+        for (int i = 0; i < Flock::numPredator; i++) {
+            avgPosition += flock.predator[i].pos()/(float)Flock::numPredator;
         }
         avgPosition /= 2.0;
 
@@ -199,41 +348,227 @@ struct MyApp : public al::App {
 
     void onDraw(al::Graphics& g) {
         g.depthTesting(true);
-        g.lighting(true);
         g.clear(1);
-        
-        for (int i = 0; i < numPrey; i++) {
-            g.color(0, 1, 0);
-            g.pushMatrix();
-            g.translate(prey[i].pos());
-            g.rotate(prey[i].quat());
-            g.scale(0.06);
-            g.draw(mesh);
-            g.popMatrix();
+
+        // one instance per agent, all drawn in a single call
+        int numPrey = flock.numPrey;
+        cones.instances.resize(numPrey + Flock::numPredator + Flock::numFood);
+        Instance* out = cones.instances.data();
+        packInstances(flock.prey.data(), numPrey, 0.06, al::Color(0, 1, 0), out);
+        packInstances(flock.predator, Flock::numPredator, 0.2, al::Color(1, 0, 0), out + numPrey);
+        packInstances(flock.food, Flock::numFood, 0.04, al::Color(0, 0, 1), out + numPrey + Flock::numPredator);
+        cones.draw(g);
+    }
+};
+
+// every heap allocation in the program goes through here so the checks can
+// count them; otherwise the same as the default
+static std::atomic<long> allocations{0};
+
+void* operator new(std::size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size > 0 ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+// SpatialGrid against a brute-force scan over every agent, on a spread out
+// flock with a dense clump in it: each query has to find exactly the agents
+// within range, then both ways of finding them are timed
+void checkSpatialGrid(CheckResults& check) {
+    const int n = 5000;
+    const float range = 0.2;
+    BoidState agents;
+    agents.x.resize(n); agents.y.resize(n); agents.z.resize(n);
+    agents.fx.assign(n, 0); agents.fy.assign(n, 0); agents.fz.assign(n, 1);
+    for (int i = 0; i < n; i++) {
+        al::Vec3d p = al::rnd::ball<al::Vec3d>() * (i % 4 == 0 ? 0.3 : 3.0);
+        agents.x[i] = p.x;
+        agents.y[i] = p.y;
+        agents.z[i] = p.z;
+    }
+
+    SpatialGrid grid(range);
+    grid.build(agents);
+    std::vector<int> fromGrid, fromScan;
+    int mismatched = 0;
+    long long found = 0;
+    for (int i = 0; i < n; i++) {
+        fromGrid.clear();
+        grid.query(agents.pos(i), range, [&](int j) {
+            if (al::dist(agents.pos(i), agents.pos(j)) <= range) fromGrid.push_back(j);
+        });
+        std::sort(fromGrid.begin(), fromGrid.end());
+        fromScan.clear();
+        for (int j = 0; j < n; j++) {
+            if (al::dist(agents.pos(i), agents.pos(j)) <= range) fromScan.push_back(j);
+        }
+        mismatched += fromGrid != fromScan;
+        found += fromScan.size();
+    }
+    check.expect(mismatched == 0, "spatial grid: %d of %d queries differ from a brute-force scan, %.1f neighbors each",
+                 mismatched, n, found / (double)n);
+
+    runHeadless("grid neighbors", n, 20, 1 / 60.0, [&](double) {
+        grid.build(agents);
+        found = 0;
+        for (int i = 0; i < n; i++) {
+            grid.query(agents.pos(i), range, [&](int j) {
+                found += al::dist(agents.pos(i), agents.pos(j)) <= range;
+            });
         }
+    });
+    runHeadless("brute-force neighbors", n, 20, 1 / 60.0, [&](double) {
+        found = 0;
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                found += al::dist(agents.pos(i), agents.pos(j)) <= range;
+            }
+        }
+    });
+}
 
-        for (int i = 0; i < numPredator; i++) {
-            g.color(1, 0, 0);
-            g.pushMatrix();
-            g.translate(predator[i].pos());
-            g.rotate(predator[i].quat());
-            g.scale(0.2);
-            g.draw(mesh);
-            g.popMatrix();
+// a steady state Flock::step allocates nothing: after one step to size the
+// grids and state arrays, and start the pool, further steps must not reach
+// operator new at all. then the neighbor sums are timed against the way
+// they were gathered before, a std::vector<al::Nav> of copies per prey
+void checkStepAllocations(CheckResults& check) {
+    Flock flock(2000);
+    flock.step();
+    long before = allocations;
+    for (int frame = 0; frame < 20; frame++) {
+        flock.step();
+    }
+    long during = allocations - before;
+    check.expect(during == 0, "flock step: %ld allocations in 20 steady state steps of 2000 prey", during);
+
+    // packed into a clump, the way the flock gathers, so every prey has
+    // dozens of neighbors
+    int n = flock.numPrey;
+    float range = flock.neighborhood;
+    for (int i = 0; i < n; i++) {
+        flock.prey[i].pos(al::rnd::ball<al::Vec3d>() * 0.6);
+    }
+    flock.preyState.capture(flock.prey.data(), n);
+    flock.preyGrid.build(flock.preyState);
+    std::vector<al::Vec3d> average(n);
+    runHeadless("neighbor sums", n, 50, 1 / 60.0, [&](double) {
+        for (int i = 0; i < n; i++) {
+            al::Vec3d sum(0);
+            int count = 0;
+            flock.preyGrid.query(flock.prey[i].pos(), range, [&](int j) {
+                if (i != j && al::dist(flock.prey[i].pos(), flock.preyState.pos(j)) <= range) {
+                    sum += flock.preyState.pos(j);
+                    sum += flock.preyState.uf(j);
+                    count++;
+                }
+            });
+            average[i] = count > 0 ? sum / (float)count : sum;
+        }
+    });
+    runHeadless("neighbor Nav copies", n, 50, 1 / 60.0, [&](double) {
+        for (int i = 0; i < n; i++) {
+            std::vector<al::Nav> inRange;
+            flock.preyGrid.query(flock.prey[i].pos(), range, [&](int j) {
+                if (i != j && al::dist(flock.prey[i].pos(), flock.prey[j].pos()) <= range) {
+                    inRange.push_back(flock.prey[j]);
+                }
+            });
+            al::Vec3d sum(0);
+            for (int j = 0; j < inRange.size(); j++) {
+                sum += inRange[j].pos() / (float)inRange.size();
+                sum += inRange[j].uf() / (float)inRange.size();
+            }
+            average[i] = sum;
         }
+    });
+}
 
-        for (int i = 0; i < numFood; i++) {
-            g.color(0, 0, 1);
-            g.pushMatrix();
-            g.translate(food[i]);
-            g.scale(0.04);
-            g.draw(mesh);
-            g.popMatrix();
+// the CPU half of the instanced draw at 100k agents, far past any flock
+// this sketch runs, has to stay under a millisecond a frame
+void checkPackInstances(CheckResults& check) {
+    const int n = 100000;
+    std::vector<al::Nav> agents(n);
+    for (int i = 0; i < n; i++) {
+        agents[i].pos(al::rnd::ball<al::Vec3d>());
+        agents[i].faceToward(al::rnd::ball<al::Vec3d>(), 1);
+    }
+    std::vector<Instance> instances(n);
+    FrameTimings timings = runHeadless("pack instances", n, 100, 1 / 60.0, [&](double) {
+        packInstances(agents.data(), n, 0.06, al::Color(0, 1, 0), instances.data());
+    });
+
+    int wrong = 0;
+    for (int i = 0; i < n; i++) {
+        const al::Vec3d& p = agents[i].pos();
+        const al::Quatd& q = agents[i].quat();
+        wrong += instances[i].offset != al::Vec4f(p.x, p.y, p.z, 0.06) ||
+                 instances[i].rotation != al::Vec4f(q.x, q.y, q.z, q.w);
+    }
+    check.expect(wrong == 0 && timings.median() < 1.0,
+                 "pack instances: %d agents in %.3f ms median (limit 1 ms), %d packed wrong",
+                 n, timings.median(), wrong);
+}
+
+// the same seed stepped on 1 and on 7 threads: steering reads only the
+// start-of-step state and every prey turns only itself, so after 200 steps
+// every pose has to come out bit for bit the same
+void checkThreadIndependence(CheckResults& check) {
+    int savedThreads = threadCount();
+    Flock flocks[2] = {Flock(2000, 7), Flock(2000, 7)};
+    const int threads[] = {1, 7};
+    for (int t = 0; t < 2; t++) {
+        setThreadCount(threads[t]);
+        for (int frame = 0; frame < 200; frame++) {
+            flocks[t].step();
         }
     }
-};
+    setThreadCount(savedThreads);
+
+    int differ = 0;
+    for (int i = 0; i < flocks[0].numPrey; i++) {
+        const al::Nav &a = flocks[0].prey[i], &b = flocks[1].prey[i];
+        differ += memcmp(&a.pos(), &b.pos(), sizeof(al::Vec3d)) != 0 ||
+                  memcmp(&a.quat(), &b.quat(), sizeof(al::Quatd)) != 0;
+    }
+    check.expect(differ == 0, "flock step: %d of %d prey poses differ between 1 and 7 threads after 200 steps",
+                 differ, flocks[0].numPrey);
+}
+
+int runChecks() {
+    CheckResults check;
+    checkSpatialGrid(check);
+    checkStepAllocations(check);
+    checkPackInstances(check);
+    checkThreadIndependence(check);
+    return check.exitCode();
+}
+
+int main(int argc, char* argv[]) {
+    parseThreads(argc, argv);
+    HeadlessOptions headless = parseHeadless(argc, argv);
+    if (headless.check) {
+        return runChecks();
+    }
+    if (headless.frames > 0) {
+        for (int size : headless.sizesOr(200)) {
+            Flock flock(size);
+            runHeadless("flocking", flock.numPrey, headless.frames, 1 / 60.0, [&](double) {
+                flock.step();
+            });
+        }
+        return 0;
+    }
 
-int main() {
     MyApp app;
     app.configureAudio(48000, 512, 2, 0);
     app.start();
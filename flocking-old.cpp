@@ -5,8 +5,10 @@
 #include "al/math/al_Random.hpp"
 #include "al/graphics/al_Shapes.hpp" // addCone
 
+#include "instanced-mesh.hpp"
+
 struct MyApp : public al::App {
-    al::Mesh mesh;
+    InstancedMesh cones;
 
     static const int numPrey = 20;
     static const int numPredator = 2;
@@ -36,8 +38,8 @@ struct MyApp : public al::App {
     }
 
     void onCreate() {
-        addCone(mesh);
-        mesh.generateNormals();
+        addCone(cones.mesh);
+        cones.init("../instance-vertex.glsl", "../instance-fragment.glsl");
 
         for (int i = 0; i < numPrey; i++) {
             prey[i].pos(al::rnd::ball<al::Vec3d>() * radius);
@@ -138,37 +140,15 @@ struct MyApp : public al::App {
 
     void onDraw(al::Graphics& g) {
         g.depthTesting(true);
-        g.lighting(true);
         g.clear(1);
-        
-        for (int i = 0; i < numPrey; i++) {
-            g.color(0, 1, 0);
-            g.pushMatrix();
-            g.translate(prey[i].pos());
-            g.rotate(prey[i].quat());
-            g.scale(0.07);
-            g.draw(mesh);
-            g.popMatrix();
-        }
-
-        for (int i = 0; i < numPredator; i++) {
-            g.color(1, 0, 0);
-            g.pushMatrix();
-            g.translate(predator[i].pos());
-            g.rotate(predator[i].quat());
-            g.scale(0.2);
-            g.draw(mesh);
-            g.popMatrix();
-        }
 
-        for (int i = 0; i < numFood; i++) {
-            g.color(0, 0, 0);
-            g.pushMatrix();
-            g.translate(food[i]);
-            g.scale(0.04);
-            g.draw(mesh);
-            g.popMatrix();
-        }
+        // one instance per agent, all drawn in a single call
+        cones.instances.resize(numPrey + numPredator + numFood);
+        Instance* out = cones.instances.data();
+        packInstances(prey, numPrey, 0.07, al::Color(0, 1, 0), out);
+        packInstances(predator, numPredator, 0.2, al::Color(1, 0, 0), out + numPrey);
+        packInstances(food, numFood, 0.04, al::Color(0, 0, 0), out + numPrey + numPredator);
+        cones.draw(g);
     }
 };
 
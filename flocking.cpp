@@ -5,8 +5,10 @@
 #include "al/math/al_Random.hpp"
 #include "al/graphics/al_Shapes.hpp" // addCone
 
+#include "instanced-mesh.hpp"
+
 struct MyApp : public al::App {
-    al::Mesh mesh;
+    InstancedMesh cones;
 
     static const int numPrey = 20;
     static const int numPredator = 2;
@@ -37,8 +39,8 @@ struct MyApp : public al::App {
     }
 
     void onCreate() {
-        addCone(mesh);
-        mesh.generateNormals();
+        addCone(cones.mesh);
+        cones.init("../instance-vertex.glsl", "../instance-fragment.glsl");
 
         for (int i = 0; i < numPrey; i++) {
             prey[i].pos(al::rnd::ball<al::Vec3d>() * radius);
@@ -66,37 +68,22 @@ struct MyApp : public al::App {
 
         
         for (int i = 0; i < numPrey; i++) {
-            std::vector<al::Nav> predatorInRange;
-            std::vector<al::Nav> preyInRange;
-            for (int j = 0; j < numPredator; j++) {
-                if (al::dist(prey[i].pos(), predator[j].pos()) <= vision) {
-                    predatorInRange.push_back(predator[j]);
-                }
-            }
+            // running sums over the neighbors, nothing is collected
+            al::Vec3d neighborhoodPos = al::Vec3d(0);
+            al::Vec3d avgUF = al::Vec3d(0);
+            int preyInRange = 0;
             for (int j = 0; j < numPrey; j++) {
                 if (i != j) {
                     if (al::dist(prey[i].pos(), prey[j].pos()) <= vision) {
-                        preyInRange.push_back(prey[j]);
+                        neighborhoodPos += prey[j].pos();
+                        avgUF += prey[j].uf();
+                        preyInRange++;
                     }
                 }
             }
-
-            al::Vec3d neighborhoodPos = al::Vec3d(0);
-            al::Vec3d predatorPos = al::Vec3d(0);
-            al::Vec3d avgUF = al::Vec3d(0);
-            if (preyInRange.size() > 0) {
-                for (int j = 0; j < preyInRange.size(); j++) {
-                    neighborhoodPos += preyInRange[j].pos();
-                    avgUF += preyInRange[j].uf();
-                }
-                neighborhoodPos /= (float)preyInRange.size();
-                avgUF /= (float)preyInRange.size();
-            }
-            if (predatorInRange.size() > 0) {
-                for (int j = 0; j < predatorInRange.size(); j++) {
-                    predatorPos += predatorInRange[j].pos();
-                }
-                predatorPos /= (float)predatorInRange.size();
+            if (preyInRange > 0) {
+                neighborhoodPos /= (float)preyInRange;
+                avgUF /= (float)preyInRange;
             }
 
             al::Vec3d closestFood = food[0];
@@ -107,7 +94,7 @@ struct MyApp : public al::App {
             }
 
             // cohesion and seperation
-            if (preyInRange.size() > 0) {
+            if (preyInRange > 0) {
                 float d = dist(prey[i].pos(), neighborhoodPos);
                 if (d > 0.2) {
                     prey[i].faceToward(neighborhoodPos, cohesion);
@@ -124,9 +111,11 @@ struct MyApp : public al::App {
             // if (predatorInRange.size() > 0) {
             //     faceAway(prey[i], predatorPos, fear);
             // }
-            for (int j = 0; j < predatorInRange.size(); j++) {
-                float d = al::dist(prey[i].pos(), predatorInRange[j].pos());
-                faceAway(prey[i], predatorInRange[j], fear/d);
+            for (int j = 0; j < numPredator; j++) {
+                float d = al::dist(prey[i].pos(), predator[j].pos());
+                if (d <= vision) {
+                    faceAway(prey[i], predator[j], fear/d);
+                }
             }
             // correction
             if (al::dist(prey[i].pos(), al::Vec3d(0)) > radius) {
@@ -179,37 +168,15 @@ struct MyApp : public al::App {
 
     void onDraw(al::Graphics& g) {
         g.depthTesting(true);
-        g.lighting(true);
         g.clear(1);
-        
-        for (int i = 0; i < numPrey; i++) {
-            g.color(0, 1, 0);
-            g.pushMatrix();
-            g.translate(prey[i].pos());
-            g.rotate(prey[i].quat());
-            g.scale(0.07);
-            g.draw(mesh);
-            g.popMatrix();
-        }
 
-        for (int i = 0; i < numPredator; i++) {
-            g.color(1, 0, 0);
-            g.pushMatrix();
-            g.translate(predator[i].pos());
-            g.rotate(predator[i].quat());
-            g.scale(0.2);
-            g.draw(mesh);
-            g.popMatrix();
-        }
-
-        for (int i = 0; i < numFood; i++) {
-            g.color(0, 0, 0);
-            g.pushMatrix();
-            g.translate(food[i]);
-            g.scale(0.04);
-            g.draw(mesh);
-            g.popMatrix();
-        }
+        // one instance per agent, all drawn in a single call
+        cones.instances.resize(numPrey + numPredator + numFood);
+        Instance* out = cones.instances.data();
+        packInstances(prey, numPrey, 0.07, al::Color(0, 1, 0), out);
+        packInstances(predator, numPredator, 0.2, al::Color(1, 0, 0), out + numPrey);
+        packInstances(food, numFood, 0.04, al::Color(0, 0, 0), out + numPrey + numPredator);
+        cones.draw(g);
     }
 };
 
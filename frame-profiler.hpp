@@ -0,0 +1,182 @@
+#ifndef FRAME_PROFILER_HPP
+#define FRAME_PROFILER_HPP
+
+// scoped timers for the per-frame hot paths. every thread records into its
+// own ring of events, so timing a scope takes no locks; with profiling off
+// a timer is one relaxed load and a branch. the rings can be written out as
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev) and the calling
+// thread's recent events summed per section for the GUI
+//
+//     PROFILE_SCOPE("rotation");
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "al/ui/al_Parameter.hpp"
+
+namespace prof {
+
+struct Event {
+    const char* name; // string literal, compared by content
+    uint64_t start;   // nanoseconds on the steady clock
+    uint64_t end;
+};
+
+struct ThreadLog {
+    static const uint32_t capacity = 1 << 14;
+    Event events[capacity];
+    std::atomic<uint32_t> count{0}; // total ever written, the ring index is count % capacity
+    int id = 0;
+};
+
+inline std::atomic<bool>& enabledFlag() {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+inline void enable(bool on) { enabledFlag().store(on, std::memory_order_relaxed); }
+inline bool enabled() { return enabledFlag().load(std::memory_order_relaxed); }
+
+// logs are never freed: one a thread gives back when it exits goes to the
+// next new thread, so short lived workers don't grow the registry
+struct Registry {
+    std::mutex mutex;
+    std::vector<ThreadLog*> logs;
+    std::vector<ThreadLog*> free;
+
+    static Registry& get() {
+        static Registry registry;
+        return registry;
+    }
+
+    ThreadLog* acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free.empty()) {
+            ThreadLog* log = free.back();
+            free.pop_back();
+            return log;
+        }
+        logs.push_back(new ThreadLog);
+        logs.back()->id = logs.size();
+        return logs.back();
+    }
+
+    void release(ThreadLog* log) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free.push_back(log);
+    }
+};
+
+struct LogHandle {
+    ThreadLog* log = Registry::get().acquire();
+    ~LogHandle() { Registry::get().release(log); }
+};
+
+inline ThreadLog& threadLog() {
+    thread_local LogHandle handle;
+    return *handle.log;
+}
+
+inline uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct ScopedTimer {
+    const char* name;
+    uint64_t start = 0;
+
+    ScopedTimer(const char* n) : name(n) {
+        if (enabled()) start = now();
+    }
+
+    ~ScopedTimer() {
+        if (start == 0) return;
+        ThreadLog& log = threadLog();
+        uint32_t i = log.count.load(std::memory_order_relaxed);
+        log.events[i % ThreadLog::capacity] = {name, start, now()};
+        log.count.store(i + 1, std::memory_order_release);
+    }
+};
+
+// overwrites path with every event still held by any thread's ring. events
+// a thread is overwriting while this runs may come out torn, so export
+// between frames or with profiling off
+inline bool exportTrace(const std::string& path) {
+    std::ofstream file(path);
+    if (!file.good()) return false;
+    file << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (ThreadLog* log : registry.logs) {
+        uint32_t count = log->count.load(std::memory_order_acquire);
+        uint32_t begin = count > ThreadLog::capacity ? count - ThreadLog::capacity : 0;
+        for (uint32_t i = begin; i < count; i++) {
+            const Event& e = log->events[i % ThreadLog::capacity];
+            file << (first ? "" : ",\n") << "{\"name\":\"" << e.name
+                 << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << log->id
+                 << ",\"ts\":" << e.start / 1000.0
+                 << ",\"dur\":" << (e.end - e.start) / 1000.0 << "}";
+            first = false;
+        }
+    }
+    file << "\n]}\n";
+    return file.good();
+}
+
+// per-section milliseconds for the GUI: each update() sums the calling
+// thread's events since the last update by name and eases every section's
+// Parameter toward its sum. with profiling off and nothing new recorded
+// it returns straight away and the Parameters keep their last values
+struct Breakdown {
+    std::vector<std::pair<const char*, al::Parameter*>> sections;
+    std::vector<float> totals;
+    uint32_t seen = 0;
+
+    void add(const char* name, al::Parameter& parameter) {
+        sections.push_back({name, &parameter});
+        totals.push_back(0);
+    }
+
+    void update(float smoothing = 0.9) {
+        ThreadLog& log = threadLog();
+        uint32_t count = log.count.load(std::memory_order_relaxed);
+        if (count == seen && !enabled()) {
+            return;
+        }
+        if (count - seen > ThreadLog::capacity) {
+            seen = count - ThreadLog::capacity;
+        }
+        std::fill(totals.begin(), totals.end(), 0.0f);
+        for (; seen < count; seen++) {
+            const Event& e = log.events[seen % ThreadLog::capacity];
+            for (size_t s = 0; s < sections.size(); s++) {
+                if (std::strcmp(e.name, sections[s].first) == 0) {
+                    totals[s] += (e.end - e.start) * 1e-6f;
+                }
+            }
+        }
+        for (size_t s = 0; s < sections.size(); s++) {
+            al::Parameter& p = *sections[s].second;
+            p.set(p.get() * smoothing + totals[s] * (1 - smoothing));
+        }
+    }
+};
+
+} // namespace prof
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) prof::ScopedTimer PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef HEADLESS_RUNNER_HPP
+#define HEADLESS_RUNNER_HPP
+
+// drives a simulation step for a fixed number of frames without a window and
+// prints per-frame timing as one line of JSON. the apps switch to it when run
+// as `app --headless <frames> [size,size,...]`, one line per size, so a
+// single run sweeps a workload across sizes, and headless-sweep.sh runs
+// every app's sweep into one JSON array. adding --profile turns the
+// scoped timers on so their overhead shows up against a run without it.
+// `app --check` instead runs the app's self checks, which compare its fast
+// paths against plain reference versions, and exits non-zero if one fails
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct HeadlessOptions {
+    int frames = 0; // 0 means run the normal app
+    std::vector<int> sizes; // workload sizes to sweep, empty means the app's default
+    bool profile = false;
+    bool check = false;
+
+    std::vector<int> sizesOr(int fallback) const {
+        return sizes.empty() ? std::vector<int>{fallback} : sizes;
+    }
+
+    std::vector<int> sizesOr(const std::vector<int>& fallback) const {
+        return sizes.empty() ? fallback : sizes;
+    }
+};
+
+inline HeadlessOptions parseHeadless(int argc, char* argv[]) {
+    HeadlessOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+            options.frames = std::atoi(argv[i + 1]);
+            if (i + 2 < argc && argv[i + 2][0] != '-') {
+                // comma separated, e.g. 1500,20000,50000
+                const char* list = argv[i + 2];
+                char* end;
+                for (long size = std::strtol(list, &end, 10); end != list; size = std::strtol(list, &end, 10)) {
+                    options.sizes.push_back((int)size);
+                    list = *end == ',' ? end + 1 : end;
+                }
+            }
+        }
+        if (std::strcmp(argv[i], "--profile") == 0) {
+            options.profile = true;
+        }
+        if (std::strcmp(argv[i], "--check") == 0) {
+            options.check = true;
+        }
+    }
+    return options;
+}
+
+struct FrameTimings {
+    std::vector<double> ms;
+
+    // nearest rank percentile, p in [0, 1]
+    double percentile(double p) const {
+        std::vector<double> sorted(ms);
+        std::sort(sorted.begin(), sorted.end());
+        int rank = (int)(p * (sorted.size() - 1) + 0.5);
+        return sorted[rank];
+    }
+
+    double median() const { return percentile(0.5); }
+
+    void print(const std::string& workload, int size, double dt) const {
+        double total = 0;
+        for (double t : ms) total += t;
+        std::printf("{\"workload\": \"%s\", \"size\": %d, \"frames\": %d, \"dt\": %g, "
+                    "\"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"mean_ms\": %.4f}\n",
+                    workload.c_str(), size, (int)ms.size(), dt,
+                    percentile(0), percentile(0.5), percentile(0.99), total / ms.size());
+    }
+};
+
+// one line per check, printf style: check.expect(bad == 0, "%d outside", bad)
+struct CheckResults {
+    int failed = 0;
+
+    void expect(bool ok, const char* format, ...) {
+        std::printf("%s ", ok ? "ok  " : "FAIL");
+        va_list args;
+        va_start(args, format);
+        std::vprintf(format, args);
+        va_end(args);
+        std::printf("\n");
+        if (!ok) failed++;
+    }
+
+    int exitCode() const {
+        std::printf("%d check%s failed\n", failed, failed == 1 ? "" : "s");
+        return failed == 0 ? 0 : 1;
+    }
+};
+
+// calls step(dt) frames times and reports how long each call took, the
+// timings come back for checks that hold them to a budget
+template <class F>
+FrameTimings runHeadless(const std::string& workload, int size, int frames, double dt, F step) {
+    FrameTimings timings;
+    timings.ms.reserve(frames);
+    for (int frame = 0; frame < frames; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        step(dt);
+        auto end = std::chrono::steady_clock::now();
+        timings.ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    if (frames > 0) {
+        timings.print(workload, size, dt);
+    }
+    return timings;
+}
+
+#endif
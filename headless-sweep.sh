@@ -0,0 +1,31 @@
+#!/bin/sh
+# the whole headless sweep as one JSON array, one object per workload and
+# size. build the apps first (allolib's run.sh leaves them in bin/), then
+#
+#     ./headless-sweep.sh [frames] [--threads N] > sweep.json
+#
+# frames defaults to 300, anything after it goes to every app
+
+cd "$(dirname "$0")/bin" || exit 1
+frames=${1:-300}
+[ $# -gt 0 ] && shift
+
+sweep() {
+    app=$1
+    sizes=$2
+    shift 2
+    if [ ! -x "./$app" ]; then
+        echo "$app isn't built, skipping it" >&2
+        return
+    fi
+    "./$app" --headless "$frames" $sizes "$@"
+}
+
+{
+    sweep final-project 1500,20000,50000,200000 "$@"
+    sweep particle 500,2000,8000 "$@"
+    sweep flocking-elijahfrankle 200,2000,20000 "$@"
+    sweep pixel-sort-elijah-frankle 250000,1000000,4000000 "$@"
+    sweep final-testing-1 8000,64000,512000 "$@"
+    sweep final-testing-3 30,300,3000 "$@"
+} | grep '^{' | sed '1s/^/[/; $!s/$/,/; $s/$/]/'
@@ -0,0 +1,16 @@
+#version 400
+
+in Vertex {
+  vec4 color;
+  vec3 normal;
+}
+vertex;
+
+layout(location = 0) out vec4 fragmentColor;
+
+void main() {
+  // a single light over the viewer's shoulder, in eye space
+  vec3 n = normalize(vertex.normal);
+  float diffuse = max(dot(n, normalize(vec3(0.3, 0.5, 1.0))), 0.0);
+  fragmentColor = vec4(vertex.color.rgb * (0.3 + 0.7 * diffuse), vertex.color.a);
+}
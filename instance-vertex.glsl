@@ -0,0 +1,29 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 3) in vec3 vertexNormal;
+
+// one of each per instance (attribute divisor 1)
+layout(location = 6) in vec4 instanceOffset;    // xyz offset, w uniform scale
+layout(location = 7) in vec4 instanceRotation;  // unit quaternion as (x, y, z, w)
+layout(location = 8) in vec4 instanceColor;
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+
+out Vertex {
+  vec4 color;
+  vec3 normal;
+}
+vertex;
+
+vec3 rotate(vec4 q, vec3 v) {
+  return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main() {
+  vec3 p = rotate(instanceRotation, vertexPosition) * instanceOffset.w + instanceOffset.xyz;
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(p, 1.0);
+  vertex.color = instanceColor;
+  vertex.normal = mat3(al_ModelViewMatrix) * rotate(instanceRotation, vertexNormal);
+}
@@ -0,0 +1,104 @@
+#ifndef INSTANCED_MESH_HPP
+#define INSTANCED_MESH_HPP
+
+// draws many copies of one mesh in one instanced call, e.g. every agent of
+// the flocking sketches as a cone or the final-testing-1 lattice as
+// octahedra. each copy is packed as offset + scale, rotation quaternion and
+// 8 bit color, 36 bytes, which instance-vertex.glsl reads as per-instance
+// attributes 6, 7 and 8
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "al/graphics/al_BufferObject.hpp"
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_VAOMesh.hpp"
+#include "al/ui/al_Pose.hpp"
+
+#include "parallel-for.hpp"
+#include "slurp.hpp"
+
+struct Instance {
+    al::Vec4f offset;   // xyz position, w scale
+    al::Vec4f rotation; // quaternion as (x, y, z, w)
+    al::Colori color;   // normalized to 0-1 by the attribute
+};
+
+// packing is memory bound, a few thousand instances is what's worth a wake up
+static const int minInstancesPerThread = 8192;
+
+// the CPU half of the instanced draw, kept separate so it can be timed alone
+inline void packInstances(const al::Nav* agents, int n, float scale, al::Color color, Instance* out) {
+    al::Colori packed(color);
+    parallelFor(n, minInstancesPerThread, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const al::Vec3d& p = agents[i].pos();
+            const al::Quatd& q = agents[i].quat();
+            out[i].offset = al::Vec4f(p.x, p.y, p.z, scale);
+            out[i].rotation = al::Vec4f(q.x, q.y, q.z, q.w);
+            out[i].color = packed;
+        }
+    });
+}
+
+// unrotated copies at the given points
+template <class T>
+void packInstances(const al::Vec<3, T>* points, int n, float scale, al::Color color, Instance* out) {
+    al::Colori packed(color);
+    parallelFor(n, minInstancesPerThread, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            out[i].offset = al::Vec4f(points[i].x, points[i].y, points[i].z, scale);
+            out[i].rotation = al::Vec4f(0, 0, 0, 1);
+            out[i].color = packed;
+        }
+    });
+}
+
+struct InstancedMesh {
+    al::VAOMesh mesh; // the shape, filled in by the caller before init
+    al::BufferObject buffer;
+    al::ShaderProgram shader;
+    std::vector<Instance> instances;
+
+    void init(std::string vertexFile, std::string fragmentFile) {
+        mesh.generateNormals();
+        mesh.decompress();
+        mesh.update();
+
+        shader.compile(slurp(vertexFile), slurp(fragmentFile));
+
+        buffer.bufferType(GL_ARRAY_BUFFER);
+        buffer.usage(GL_STREAM_DRAW);
+        buffer.create();
+
+        mesh.vao().bind();
+        buffer.bind();
+        for (int a = 0; a < 3; a++) {
+            glEnableVertexAttribArray(6 + a);
+            glVertexAttribDivisor(6 + a, 1);
+        }
+        glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, offset));
+        glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, rotation));
+        glVertexAttribPointer(8, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Instance), (void*)offsetof(Instance, color));
+        mesh.vao().unbind();
+    }
+
+    // draws every instance, uploading them first unless the caller knows
+    // they haven't changed since the last draw
+    void draw(al::Graphics& g, bool upload = true) {
+        g.shader(shader);
+        g.update();
+
+        if (upload) {
+            buffer.bind();
+            buffer.data(sizeof(Instance) * instances.size(), instances.data());
+        }
+
+        mesh.vao().bind();
+        glDrawArraysInstanced(GL_TRIANGLES, 0, mesh.vertices().size(), instances.size());
+        mesh.vao().unbind();
+    }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef PARALLEL_FOR_HPP
+#define PARALLEL_FOR_HPP
+
+// splits a loop over [0, n) into contiguous chunks and runs them on a pool of
+// worker threads that is started once and then reused, so a per-frame loop
+// costs a wake up instead of starting and joining threads, and allocates
+// nothing. the calling thread runs chunks too:
+//
+//     parallelFor(numParticles, 4096, [&](int begin, int end) { ... });
+//
+// every chunk gets at least minChunk items, so small counts stay on the
+// calling thread. chunk boundaries depend only on n, minChunk and the pool
+// size, never on which thread picks a chunk up. every app takes
+// `--threads N` to size the pool, the default is one thread per core
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::mutex runMutex; // one job at a time
+
+    // the current job, written under mutex before generation is bumped
+    void (*call)(void*, int, int) = nullptr;
+    void* context = nullptr;
+    int n = 0;
+    int numChunks = 0;
+    std::atomic<int> nextChunk{0};
+    int busy = 0; // workers that haven't finished the current job yet
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    explicit ThreadPool(int threads) {
+        for (int t = 1; t < threads; t++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    int size() const { return workers.size() + 1; }
+
+    // true on the pool's threads, and on the caller while its job runs, where
+    // a nested parallelFor runs serially
+    static bool& insideWorker() {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+    void runChunks() {
+        int c;
+        while ((c = nextChunk.fetch_add(1)) < numChunks) {
+            call(context, (int)((int64_t)n * c / numChunks), (int)((int64_t)n * (c + 1) / numChunks));
+        }
+    }
+
+    void work() {
+        insideWorker() = true;
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            runChunks();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+    // returns once every chunk has run and no worker touches the job anymore
+    void run(int count, int chunks, void (*f)(void*, int, int), void* ctx) {
+        std::lock_guard<std::mutex> running(runMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            call = f;
+            context = ctx;
+            n = count;
+            numChunks = chunks;
+            nextChunk = 0;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        insideWorker() = true;
+        runChunks();
+        insideWorker() = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return busy == 0; });
+    }
+};
+
+// worker count including the calling thread, 0 means one per core
+inline int& threadCount() {
+    static int threads = 0;
+    return threads;
+}
+
+inline std::unique_ptr<ThreadPool>& poolInstance() {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+// started on first use, from the main thread
+inline ThreadPool& threadPool() {
+    std::unique_ptr<ThreadPool>& pool = poolInstance();
+    if (!pool) {
+        pool.reset(new ThreadPool(threadCount() > 0 ? threadCount()
+                                                    : std::max(1u, std::thread::hardware_concurrency())));
+    }
+    return *pool;
+}
+
+// restarts the pool with a new size. never while a parallelFor is running
+inline void setThreadCount(int threads) {
+    threadCount() = threads;
+    poolInstance().reset();
+}
+
+// reads `--threads N`, for main to call before anything runs a parallelFor
+inline void parseThreads(int argc, char* argv[]) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0) {
+            setThreadCount(std::atoi(argv[i + 1]));
+        }
+    }
+}
+
+template <class F>
+void parallelFor(int n, int minChunk, F f) {
+    ThreadPool& pool = threadPool();
+    int chunks = std::min(pool.size(), n / std::max(1, minChunk));
+    if (chunks <= 1 || ThreadPool::insideWorker()) {
+        f(0, n);
+        return;
+    }
+    pool.run(n, chunks, [](void* context, int begin, int end) { (*static_cast<F*>(context))(begin, end); }, &f);
+}
+
+#endif
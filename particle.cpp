@@ -5,26 +5,234 @@
 #include "al/app/al_GUIDomain.hpp"
 #include "al/math/al_Random.hpp"
 
+#include "headless-runner.hpp"
+#include "parallel-for.hpp"
+#include "slurp.hpp"
+
 using namespace al;
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <numeric>
 #include <vector>
 using namespace std;
 
 Vec3f randomVec3f(float scale) {
   return Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS()) * scale;
 }
-string slurp(string fileName);  // forward declaration
 
-struct AlloApp : App {
-  Parameter pointSize{"/pointSize", "", 1.0, 0.0, 2.0};
-  Parameter timeStep{"/timeStep", "", 0.1, 0.01, 0.6};
-  Parameter dragFactor{"/dragFactor", "", 2.0, 0.0, 3.0};
-  Parameter sphereRadius{"/sphereRadius", "", 1.5, 0.1, 4.0};
-  Parameter springConstant{"/springConstant", "", 20.0, 0.0, 40.0};
-  Parameter coulombConstant{"/coulombConstant", "", 0.0015, 0.0005, 0.005};
+// Barnes-Hut octree: a distant group of charges acts like its total charge
+// sitting at its center of charge, so the Coulomb sum is O(n log n)
+struct Octree {
+  struct Node {
+    Vec3f center;  // center of the node's cube
+    float halfSize;
+    float charge;  // sum of the charges inside
+    Vec3f chargeCenter;
+    int first, count;  // the node's particles are order[first..first+count)
+    int child[8];      // -1 where an octant is empty, all -1 for a leaf
+    bool leaf;
+  };
 
-  ShaderProgram pointShader;
+  static const int leafSize = 8;
+  static const int maxDepth = 24;
+
+  vector<Node> nodes;
+  vector<int> order;
+  const Vec3f *position = nullptr;
+  const float *charge = nullptr;
+
+  void build(const vector<Vec3f> &p, const vector<float> &q) {
+    position = p.data();
+    charge = q.data();
+    nodes.clear();
+    order.resize(p.size());
+    iota(order.begin(), order.end(), 0);
+    if (p.empty()) return;
+
+    Vec3f lo = p[0], hi = p[0];
+    for (auto &v : p) {
+      for (int k = 0; k < 3; k++) {
+        lo[k] = min(lo[k], v[k]);
+        hi[k] = max(hi[k], v[k]);
+      }
+    }
+    Vec3f extent = hi - lo;
+    float halfSize = max(extent.x, max(extent.y, extent.z)) * 0.5f + 1e-5f;
+    buildNode((lo + hi) * 0.5f, halfSize, 0, p.size(), 0);
+  }
+
+  int buildNode(Vec3f center, float halfSize, int first, int count, int depth) {
+    int index = nodes.size();
+    nodes.emplace_back();
+
+    Node n;
+    n.center = center;
+    n.halfSize = halfSize;
+    n.first = first;
+    n.count = count;
+    n.charge = 0;
+    n.chargeCenter = Vec3f(0);
+    for (int k = first; k < first + count; k++) {
+      n.charge += charge[order[k]];
+      n.chargeCenter += position[order[k]] * charge[order[k]];
+    }
+    n.chargeCenter /= n.charge;
+    n.leaf = count <= leafSize || depth >= maxDepth;
+    fill(n.child, n.child + 8, -1);
+
+    if (!n.leaf) {
+      // split into octants with nested partitions on x, then y, then z;
+      // octant k is on the + side of x if k & 4, of y if k & 2, of z if k & 1
+      const Vec3f *p = position;
+      auto below = [&](int axis) {
+        return [=](int j) { return p[j][axis] <= center[axis]; };
+      };
+      int *b = order.data() + first;
+      int *e = b + count;
+      int *mx = partition(b, e, below(0));
+      int *my0 = partition(b, mx, below(1));
+      int *my1 = partition(mx, e, below(1));
+      int *bounds[9] = {b, partition(b, my0, below(2)), my0,
+                        partition(my0, mx, below(2)), mx,
+                        partition(mx, my1, below(2)), my1,
+                        partition(my1, e, below(2)), e};
+
+      float h = halfSize * 0.5f;
+      for (int k = 0; k < 8; k++) {
+        int childCount = bounds[k + 1] - bounds[k];
+        if (childCount == 0) continue;
+        Vec3f c = center + Vec3f(k & 4 ? h : -h, k & 2 ? h : -h, k & 1 ? h : -h);
+        n.child[k] = buildNode(c, h, bounds[k] - order.data(), childCount, depth + 1);
+      }
+    }
+
+    nodes[index] = n;
+    return index;
+  }
+
+  // sum over every other particle j of (p_i - p_j) * q_j / |p_i - p_j|^2.
+  // a node is used as a whole when its size / distance is below theta and
+  // particle i is not inside it; theta = 0 gives the exact sum
+  Vec3f field(int i, float theta) const {
+    Vec3f pi = position[i];
+    Vec3f f(0);
+    int stack[8 * maxDepth + 8];
+    int top = 0;
+    if (!nodes.empty()) stack[top++] = 0;
+
+    while (top > 0) {
+      const Node &n = nodes[stack[--top]];
+      if (n.leaf) {
+        for (int k = n.first; k < n.first + n.count; k++) {
+          int j = order[k];
+          if (j == i) continue;
+          Vec3f d = pi - position[j];
+          f += d * (charge[j] / d.magSqr());
+        }
+        continue;
+      }
+
+      Vec3f d = pi - n.chargeCenter;
+      float r2 = d.magSqr();
+      float size = 2 * n.halfSize;
+      bool inside = abs(pi.x - n.center.x) <= n.halfSize &&
+                    abs(pi.y - n.center.y) <= n.halfSize &&
+                    abs(pi.z - n.center.z) <= n.halfSize;
+      if (!inside && size * size < theta * theta * r2) {
+        f += d * (n.charge / r2);
+      } else {
+        for (int k = 0; k < 8; k++) {
+          if (n.child[k] >= 0) stack[top++] = n.child[k];
+        }
+      }
+    }
+    return f;
+  }
+};
+
+// the asymmetric all-pairs hue force. positions and hues are packed into flat
+// arrays and the j loop walks them in tiles small enough to stay in L1; the
+// i range is split across threads and each i only writes its own force.
+// inside a tile, lanes consecutive i are done together with one accumulator
+// per lane, so the lane loop vectorizes without reordering any i's sum
+struct HueForceKernel {
+  // j values per pass over a block of rows, sized so a tile of x, y, z and h
+  // stays in L1; --check sweeps it
+  int tileSize = 512;
+  static const int lanes = 8;
+  static const int minRowsPerThread = 128;
+
+  vector<float> x, y, z, h;
+
+  void compute(const vector<Vec3f> &p, const vector<float> &hues, float k,
+               vector<Vec3f> &force) {
+    int n = p.size();
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    h.resize(n);
+    for (int i = 0; i < n; i++) {
+      x[i] = p[i].x;
+      y[i] = p[i].y;
+      z[i] = p[i].z;
+      h[i] = hues[i];
+    }
+
+    parallelFor(n, minRowsPerThread, [&](int begin, int end) {
+      const float *px = x.data(), *py = y.data(), *pz = z.data(), *ph = h.data();
+      for (int t0 = 0; t0 < n; t0 += tileSize) {
+        int t1 = min(n, t0 + tileSize);
+        for (int i0 = begin; i0 < end; i0 += lanes) {
+          float xi[lanes], yi[lanes], zi[lanes], hi[lanes];
+          float fx[lanes] = {}, fy[lanes] = {}, fz[lanes] = {};
+          for (int l = 0; l < lanes; l++) {
+            // lanes past end repeat the last i and are dropped below
+            int i = min(i0 + l, end - 1);
+            xi[l] = px[i];
+            yi[l] = py[i];
+            zi[l] = pz[i];
+            hi[l] = ph[i];
+          }
+          for (int j = t0; j < t1; j++) {
+            float xj = px[j], yj = py[j], zj = pz[j], hj = ph[j];
+            for (int l = 0; l < lanes; l++) {
+              float dx = xi[l] - xj;
+              float dy = yi[l] - yj;
+              float dz = zi[l] - zj;
+              float r2 = dx * dx + dy * dy + dz * dz;
+              float hueDif = hj - hi[l];
+              hueDif += hueDif < 0 ? 1.0f : 0.0f;
+              // attracted to similar hues, repulsed by different ones
+              float sign = hueDif <= 0.5f ? -1.0f : 1.0f;
+              // no branch on r2 == 0, which would keep the loop scalar: j == i
+              // has dx == 0 and adds nothing, and for any real distance the
+              // 1e-30 is below float precision
+              float s = sign * k / (r2 + 1e-30f);
+              fx[l] += dx * s;
+              fy[l] += dy * s;
+              fz[l] += dz * s;
+            }
+          }
+          for (int l = 0; l < lanes && i0 + l < end; l++) {
+            force[i0 + l] += Vec3f(fx[l], fy[l], fz[l]);
+          }
+        }
+      }
+    });
+  }
+};
+
+// the physics alone, no window or GL needed: the app copies its GUI
+// parameters in before stepping and draws mesh, the headless runner only
+// steps it
+struct ParticleSim {
+  float dragFactor = 2.0;
+  float sphereRadius = 1.5;
+  float springConstant = 20.0;
+  float coulombConstant = 0.0015;
+  float openingAngle = 0.5;
 
   //  simulation state
   Mesh mesh;  // position *is inside the mesh* mesh.vertices() are the positions
@@ -33,26 +241,16 @@ struct AlloApp : App {
   vector<float> mass;
   vector<float> hues;
   int mode = 1;
+  Octree tree;
+  HueForceKernel hueKernel;
 
-  void onInit() override {
-    // set up GUI
-    auto GUIdomain = GUIDomain::enableGUI(defaultWindowDomain());
-    auto &gui = GUIdomain->newGUI();
-    gui.add(pointSize);  // add parameter to GUI
-    gui.add(timeStep);   // add parameter to GUI
-    gui.add(dragFactor);   // add parameter to GUI
-    gui.add(springConstant);
-    gui.add(coulombConstant);
-    gui.add(sphereRadius);
-    //
-  }
-
-  void onCreate() override {
-    // compile shaders
-    pointShader.compile(slurp("../point-vertex.glsl"),
-                        slurp("../point-fragment.glsl"),
-                        slurp("../point-geometry.glsl"));
+  int integrator = 0;  // 0 semi-implicit Euler, 1 velocity Verlet, 2 RK4
+  vector<Vec3f> acceleration;
+  vector<Vec3f> rkPosition;
+  vector<Vec3f> rkVelocity[4];
+  vector<Vec3f> rkAcceleration[4];
 
+  void init(int count) {
     // set initial conditions of the simulation
     //
 
@@ -62,7 +260,7 @@ struct AlloApp : App {
     mesh.primitive(Mesh::POINTS);
     // does 1000 work on your system? how many can you make before you get a low
     // frame rate? do you need to use <1000?
-    for (int _ = 0; _ < 2000; _++) {
+    for (int _ = 0; _ < count; _++) {
       mesh.vertex(randomVec3f(5));
       HSV color = randomColor();
       mesh.color(color);
@@ -80,14 +278,11 @@ struct AlloApp : App {
       velocity.push_back(randomVec3f(0.1));
       force.push_back(randomVec3f(1));
     }
-
-    nav().pos(0, 0, 10);
   }
 
-  bool freeze = false;
-  void onAnimate(double dt) override {
-    if (freeze) return;
-
+  // acceleration of every particle for the given positions and velocities
+  void computeAcceleration(const vector<Vec3f> &position,
+                           const vector<Vec3f> &vel, vector<Vec3f> &acc) {
     // Calculate forces
 
     // XXX you put code here that calculates gravitational forces and sets
@@ -108,72 +303,179 @@ struct AlloApp : App {
     // • .dot(Vec3f f) 
     // • .cross(Vec3f f)
 
+    int n = position.size();
+    acc.assign(n, Vec3f(0));
+
     // Hooke's law
-    for (int i = 0; i < velocity.size(); i++) {
-      force[i] += (-mesh.vertices()[i] + (Vec3f(mesh.vertices()[i]).normalize() * sphereRadius)) * springConstant;
+    for (int i = 0; i < n; i++) {
+      acc[i] += (-position[i] + (Vec3f(position[i]).normalize() * sphereRadius)) * springConstant;
     }
 
     // equilibruim based on Coloumb's law with mass as charges
     if (mode == 1) {
-      for (int i = 0; i < velocity.size(); i++) {
-        for (int j = i+1; j < velocity.size(); j++) {
-          float r2 = pow(((mesh.vertices()[i]-mesh.vertices()[j]).mag()), 2);
-          Vec3f f = (mesh.vertices()[i]-mesh.vertices()[j]) * mass[i] * mass[j] * (coulombConstant / r2);
-          force[i] += f;
-          force[j] -= f;
-        }
+      tree.build(position, mass);
+      for (int i = 0; i < n; i++) {
+        acc[i] += tree.field(i, openingAngle) * mass[i] * coulombConstant;
       }
     }
     // the larger the difference in hue is, the more they are repulsed
     else if (mode == 2) {
-      for (int i = 0; i < velocity.size(); i++) {
-        for (int j = i+1; j < velocity.size(); j++) {
-          float r2 = pow(((mesh.vertices()[i]-mesh.vertices()[j]).mag()), 2);
-          Vec3f f = (mesh.vertices()[i]-mesh.vertices()[j]) * (coulombConstant / r2);
+      for (int i = 0; i < n; i++) {
+        for (int j = i+1; j < n; j++) {
+          float r2 = (position[i]-position[j]).magSqr();
+          Vec3f f = (position[i]-position[j]) * (coulombConstant / r2);
           float hueDif = (abs(hues[i]-hues[j]) < abs(hues[i]-hues[j]-1.0)) ? abs(hues[i]-hues[j]) : abs(hues[i]-hues[j]-1.0);
-          force[i] += f * hueDif;
-          force[j] -= f * hueDif;
+          acc[i] += f * hueDif;
+          acc[j] -= f * hueDif;
         }
       }
     }
     // asymmetrically attracted to similar hues and repulsed by different hues
     else if (mode == 3) {
-      for (int i = 0; i < velocity.size(); i++) {
-        for (int j = 0; j < velocity.size(); j++) {
-          if (i != j) {
-            float r2 = pow(((mesh.vertices()[i]-mesh.vertices()[j]).mag()), 2);
-            Vec3f f = (mesh.vertices()[i]-mesh.vertices()[j]) * (coulombConstant / r2);
-            float hueDif = hues[j] - hues[i];
-            if (hueDif < 0) {
-              hueDif += 1.0;
-            }
-            if (hueDif <= 0.5) {
-              force[i] -= f;
-            } else {
-              force[i] += f;
-            }
-          }
-        }
-      }
+      hueKernel.compute(position, hues, coulombConstant, acc);
     }
 
     // drag
-    for (int i = 0; i < velocity.size(); i++) {
-      force[i] += - velocity[i] * dragFactor;
+    for (int i = 0; i < n; i++) {
+      acc[i] += - vel[i] * dragFactor;
     }
 
-    // Integration
-    //
+    // outside forces (key 1) act for the whole step, then F = ma
+    for (int i = 0; i < n; i++) {
+      acc[i] = (acc[i] + force[i]) / mass[i];
+    }
+  }
+
+  void step(float h) {
     vector<Vec3f> &position(mesh.vertices());
-    for (int i = 0; i < velocity.size(); i++) {
+    int n = position.size();
+
+    if (integrator == 0) {
       // "semi-implicit" Euler integration
-      velocity[i] += force[i] / mass[i] * timeStep;
-      position[i] += velocity[i] * timeStep;
+      computeAcceleration(position, velocity, acceleration);
+      for (int i = 0; i < n; i++) {
+        velocity[i] += acceleration[i] * h;
+        position[i] += velocity[i] * h;
+      }
+    } else if (integrator == 1) {
+      // velocity Verlet; drag sees the half step velocity
+      computeAcceleration(position, velocity, acceleration);
+      for (int i = 0; i < n; i++) {
+        velocity[i] += acceleration[i] * (h / 2);
+        position[i] += velocity[i] * h;
+      }
+      computeAcceleration(position, velocity, acceleration);
+      for (int i = 0; i < n; i++) {
+        velocity[i] += acceleration[i] * (h / 2);
+      }
+    } else {
+      // classic RK4 on (position, velocity)
+      const float offset[4] = {0, h / 2, h / 2, h};
+      const float weight[4] = {1, 2, 2, 1};
+      rkPosition.resize(n);
+      rkVelocity[0] = velocity;
+      computeAcceleration(position, velocity, rkAcceleration[0]);
+      for (int s = 1; s < 4; s++) {
+        rkVelocity[s].resize(n);
+        for (int i = 0; i < n; i++) {
+          rkPosition[i] = position[i] + rkVelocity[s-1][i] * offset[s];
+          rkVelocity[s][i] = velocity[i] + rkAcceleration[s-1][i] * offset[s];
+        }
+        computeAcceleration(rkPosition, rkVelocity[s], rkAcceleration[s]);
+      }
+      for (int i = 0; i < n; i++) {
+        Vec3f dx(0), dv(0);
+        for (int s = 0; s < 4; s++) {
+          dx += rkVelocity[s][i] * weight[s];
+          dv += rkAcceleration[s][i] * weight[s];
+        }
+        position[i] += dx * (h / 6);
+        velocity[i] += dv * (h / 6);
+      }
     }
+  }
 
-    // clear all accelerations (IMPORTANT!!)
+  // clear all accelerations (IMPORTANT!!)
+  void clearForces() {
     for (auto &a : force) a.set(0);
   }
+};
+
+struct AlloApp : App {
+  Parameter pointSize{"/pointSize", "", 1.0, 0.0, 2.0};
+  Parameter timeStep{"/timeStep", "", 0.1, 0.01, 0.6};
+  Parameter dragFactor{"/dragFactor", "", 2.0, 0.0, 3.0};
+  Parameter sphereRadius{"/sphereRadius", "", 1.5, 0.1, 4.0};
+  Parameter springConstant{"/springConstant", "", 20.0, 0.0, 40.0};
+  Parameter coulombConstant{"/coulombConstant", "", 0.0015, 0.0005, 0.005};
+  Parameter openingAngle{"/openingAngle", "", 0.5, 0.0, 1.5};
+  ParameterInt substeps{"/substeps", "", 1, 1, 8};
+
+  ShaderProgram pointShader;
+
+  ParticleSim sim;
+
+  // integration runs at a fixed stepRate steps per second of real time, each
+  // step advancing the simulation by timeStep split into substeps
+  const double stepRate = 60;
+  const int maxStepsPerFrame = 4;
+  double accumulator = 0;
+
+  void onInit() override {
+    // set up GUI
+    auto GUIdomain = GUIDomain::enableGUI(defaultWindowDomain());
+    auto &gui = GUIdomain->newGUI();
+    gui.add(pointSize);  // add parameter to GUI
+    gui.add(timeStep);   // add parameter to GUI
+    gui.add(dragFactor);   // add parameter to GUI
+    gui.add(springConstant);
+    gui.add(coulombConstant);
+    gui.add(sphereRadius);
+    gui.add(openingAngle);
+    gui.add(substeps);
+    //
+  }
+
+  void onCreate() override {
+    // compile shaders
+    pointShader.compile(slurp("../point-vertex.glsl"),
+                        slurp("../point-fragment.glsl"),
+                        slurp("../point-geometry.glsl"));
+
+    // set initial conditions of the simulation
+    sim.init(2000);
+
+    nav().pos(0, 0, 10);
+  }
+
+  bool freeze = false;
+  void onAnimate(double dt) override {
+    if (freeze) return;
+
+    // fixed timestep: take as many steps as real time has passed, but never
+    // more than maxStepsPerFrame so a slow frame can't snowball
+    int numSubsteps = substeps;
+    float h = timeStep;
+    h /= numSubsteps;
+
+    sim.dragFactor = dragFactor;
+    sim.sphereRadius = sphereRadius;
+    sim.springConstant = springConstant;
+    sim.coulombConstant = coulombConstant;
+    sim.openingAngle = openingAngle;
+
+    accumulator += dt;
+    int steps = 0;
+    while (accumulator >= 1 / stepRate && steps < maxStepsPerFrame) {
+      for (int s = 0; s < numSubsteps; s++) {
+        sim.step(h);
+        sim.clearForces();
+      }
+      accumulator -= 1 / stepRate;
+      steps++;
+    }
+    accumulator = min(accumulator, 1 / stepRate);
+  }
 
   bool onKeyDown(const Keyboard &k) override {
     if (k.key() == ' ') {
@@ -182,19 +484,28 @@ struct AlloApp : App {
 
     if (k.key() == '1') {
       // introduce some "random" forces
-      for (int i = 0; i < velocity.size(); i++) {
+      for (int i = 0; i < sim.velocity.size(); i++) {
         // F = ma
-        force[i] += randomVec3f(1);
+        sim.force[i] += randomVec3f(1);
       }
     }
     else if (k.key() == '2') {
-      mode = 1;
+      sim.mode = 1;
     }
     else if (k.key() == '3') {
-      mode = 2;
+      sim.mode = 2;
     }
     else if (k.key() == '4') {
-      mode = 3;
+      sim.mode = 3;
+    }
+    else if (k.key() == '5') {
+      sim.integrator = 0;
+    }
+    else if (k.key() == '6') {
+      sim.integrator = 1;
+    }
+    else if (k.key() == '7') {
+      sim.integrator = 2;
     }
 
     return true;
@@ -207,23 +518,216 @@ struct AlloApp : App {
     g.blending(true);
     g.blendTrans();
     g.depthTesting(true);
-    g.draw(mesh);
+    g.draw(sim.mesh);
   }
 };
 
-int main() {
-  AlloApp app;
-  app.configureAudio(48000, 512, 2, 0);
-  app.start();
+// Octree::field against the exact pairwise sum over 10000 particles in a
+// shell, like the sphere the spring pulls them into: theta = 0 has to give
+// the exact sum and the error has to grow with theta, then the tree and the
+// pairwise sum are both timed
+void checkOctree(CheckResults &check) {
+  const int n = 10000;
+  vector<Vec3f> p(n);
+  vector<float> q(n);
+  for (int i = 0; i < n; i++) {
+    p[i] = randomVec3f(1).normalize() * (1.5f + 0.1f * rnd::uniformS());
+    q[i] = max(0.5f, 3 + rnd::normal() / 2);
+  }
+
+  vector<Vec3f> exact(n);
+  auto pairwise = [&]() {
+    for (int i = 0; i < n; i++) {
+      Vec3f f(0);
+      for (int j = 0; j < n; j++) {
+        if (j == i) continue;
+        Vec3f d = p[i] - p[j];
+        f += d * (q[j] / d.magSqr());
+      }
+      exact[i] = f;
+    }
+  };
+  pairwise();
+
+  Octree tree;
+  tree.build(p, q);
+  const float thetas[] = {0, 0.3, 0.5, 0.8};
+  const float limits[] = {1e-4, 0.01, 0.03, 0.08};
+  for (int t = 0; t < 4; t++) {
+    double errorSqr = 0;
+    for (int i = 0; i < n; i++) {
+      errorSqr += (tree.field(i, thetas[t]) - exact[i]).magSqr() / exact[i].magSqr();
+    }
+    float rms = sqrt(errorSqr / n);
+    check.expect(rms < limits[t], "octree: theta %.1f, rms relative error %g against the pairwise sum",
+                 thetas[t], rms);
+  }
+
+  vector<Vec3f> approx(n);
+  runHeadless("octree field", n, 10, 1 / 60.0, [&](double) {
+    tree.build(p, q);
+    for (int i = 0; i < n; i++) {
+      approx[i] = tree.field(i, 0.5);
+    }
+  });
+  runHeadless("pairwise field", n, 3, 1 / 60.0, [&](double) {
+    pairwise();
+  });
 }
 
-string slurp(string fileName) {
-  fstream file(fileName);
-  string returnValue = "";
-  while (file.good()) {
-    string line;
-    getline(file, line);
-    returnValue += line + "\n";
+// HueForceKernel against the plain all-pairs loop it replaced: each i adds
+// its j in the same order but per tile, so the two agree to rounding. the
+// kernel's own result can't depend on how rows are split over threads, so
+// on 1 and 7 threads it has to be bit for bit the same. both are timed, the
+// kernel at several tile sizes, and have to agree at each
+void checkHueKernel(CheckResults &check) {
+  const int n = 4000;
+  const float k = 0.0015;
+  vector<Vec3f> p(n);
+  vector<float> hues(n);
+  for (int i = 0; i < n; i++) {
+    p[i] = randomVec3f(5);
+    hues[i] = rnd::uniform();
   }
-  return returnValue;
+
+  vector<Vec3f> plain(n);
+  auto allPairs = [&]() {
+    for (int i = 0; i < n; i++) {
+      Vec3f f(0);
+      for (int j = 0; j < n; j++) {
+        if (j == i) continue;
+        Vec3f d = p[i] - p[j];
+        float hueDif = hues[j] - hues[i];
+        if (hueDif < 0) hueDif += 1;
+        f += d * ((hueDif <= 0.5f ? -k : k) / d.magSqr());
+      }
+      plain[i] = f;
+    }
+  };
+  allPairs();
+
+  HueForceKernel kernel;
+  int savedThreads = threadCount();
+  vector<Vec3f> forces[2];
+  const int threads[] = {1, 7};
+  for (int t = 0; t < 2; t++) {
+    setThreadCount(threads[t]);
+    forces[t].assign(n, Vec3f(0));
+    kernel.compute(p, hues, k, forces[t]);
+  }
+  setThreadCount(savedThreads);
+  bool identical = memcmp(forces[0].data(), forces[1].data(), n * sizeof(Vec3f)) == 0;
+  check.expect(identical, "hue kernel: forces identical on 1 and 7 threads");
+
+  FrameTimings plainTimings = runHeadless("hue all pairs", n, 5, 1 / 60.0, [&](double) {
+    allPairs();
+  });
+  double pairs = double(n) * n;
+  double plainRate = pairs / (plainTimings.median() / 1000);
+
+  vector<Vec3f> force(n);
+  for (int tileSize : {64, 256, 512, 2048, n}) {
+    kernel.tileSize = tileSize;
+    force.assign(n, Vec3f(0));
+    kernel.compute(p, hues, k, force);
+    double errorSqr = 0, signalSqr = 0;
+    for (int i = 0; i < n; i++) {
+      errorSqr += (force[i] - plain[i]).magSqr();
+      signalSqr += plain[i].magSqr();
+    }
+    float relative = sqrt(errorSqr / signalSqr);
+    FrameTimings timings = runHeadless("hue kernel", n, 20, 1 / 60.0, [&](double) {
+      kernel.compute(p, hues, k, force);
+    });
+    double rate = pairs / (timings.median() / 1000);
+    check.expect(relative < 1e-4f && rate > plainRate,
+                 "hue kernel: tile %d, %.3g pairs/s against %.3g for the all-pairs loop, relative rms difference %g",
+                 tileSize, rate, plainRate, relative);
+  }
+}
+
+// each integrator on the spring alone, no drag, Coulomb or outside forces,
+// so kinetic plus spring energy should stay put. over 1000 steps of the
+// default timeStep, at the default spring constant and at the GUI's
+// stiffest, the relative energy drift at the end and the worst swing on the
+// way are reported; the symplectic ones swing but come back. a swing past
+// 50% at the default counts as blowing up. then step() is timed for each, in
+// the default Coulomb mode
+void checkIntegrators(CheckResults &check) {
+  const char *names[] = {"semi-implicit Euler", "velocity Verlet", "RK4"};
+  const float springs[] = {20, 40};
+  const int steps = 1000;
+  const float h = 0.1;
+
+  for (int integrator = 0; integrator < 3; integrator++) {
+    for (float spring : springs) {
+      ParticleSim sim;
+      sim.init(500);
+      sim.clearForces();
+      sim.mode = 0;
+      sim.dragFactor = 0;
+      sim.springConstant = spring;
+      sim.integrator = integrator;
+
+      auto energy = [&]() {
+        double e = 0;
+        const vector<Vec3f> &p = sim.mesh.vertices();
+        for (int i = 0; i < p.size(); i++) {
+          float stretch = p[i].mag() - sim.sphereRadius;
+          e += 0.5 * sim.mass[i] * sim.velocity[i].magSqr() + 0.5 * spring * stretch * stretch;
+        }
+        return e;
+      };
+      double start = energy();
+      double worst = 0;
+      for (int s = 0; s < steps; s++) {
+        sim.step(h);
+        worst = max(worst, abs(energy() - start) / start);
+      }
+      double drift = (energy() - start) / start;
+      bool stable = spring != springs[0] || worst < 0.5;
+      check.expect(stable, "integrator %s, spring %g: energy drift %+.3g%% after %d steps, worst swing %.3g%%",
+                   names[integrator], spring, 100 * drift, steps, 100 * worst);
+    }
+
+    ParticleSim sim;
+    sim.init(2000);
+    sim.integrator = integrator;
+    runHeadless(names[integrator], 2000, 50, h, [&](double) {
+      sim.step(h);
+      sim.clearForces();
+    });
+  }
+}
+
+int runChecks() {
+  CheckResults check;
+  checkOctree(check);
+  checkHueKernel(check);
+  checkIntegrators(check);
+  return check.exitCode();
+}
+
+int main(int argc, char *argv[]) {
+  parseThreads(argc, argv);
+  HeadlessOptions headless = parseHeadless(argc, argv);
+  if (headless.check) {
+    return runChecks();
+  }
+  if (headless.frames > 0) {
+    // one step of the default timeStep per frame, Barnes-Hut Coulomb mode
+    for (int size : headless.sizesOr(2000)) {
+      ParticleSim sim;
+      sim.init(size);
+      runHeadless("coulomb", sim.mesh.vertices().size(), headless.frames, 1 / 60.0, [&](double) {
+        sim.step(0.1);
+        sim.clearForces();
+      });
+    }
+    return 0;
+  }
+
+  AlloApp app;
+  app.configureAudio(48000, 512, 2, 0);
+  app.start();
 }
@@ -7,17 +7,173 @@
 #include "al/graphics/al_Image.hpp"
 #include "al/io/al_File.hpp"
 
+#include "headless-runner.hpp"
+#include "parallel-for.hpp"
+#include "slurp.hpp"
+
 using namespace al;
 
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <vector>
 using namespace std;
 
-string slurp(string fileName);  // forward declaration
+// per-pixel loops smaller than this stay on the calling thread
+static const int minPixelsPerThread = 16384;
+
+// every layout the points can morph into, one position per pixel. colors
+// and point sizes are the same in every layout, so only current holds them.
+// each layout is its own array, and a morph reads exactly one of them
+// start to end. x, y and z stay together because the target is copied into
+// the Mesh's Vec3f vertices and stepped as one flat float stream, so split
+// components would only add a gather per frame
+struct Layouts {
+  vector<Vec3f> original;
+  vector<Vec3f> rgb;
+  vector<Vec3f> hsv;
+  vector<Vec3f> your_style;
+  vector<Vec3f> sorted;
+
+  void resize(int n) {
+    original.resize(n);
+    rgb.resize(n);
+    hsv.resize(n);
+    your_style.resize(n);
+    sorted.resize(n);
+  }
+};
+
+// stable LSD radix sort of the indices in order by keys[index], eight bits
+// per pass over the low `bits` bits. each pass histograms fixed blocks of
+// order in parallel, then scatters every block into its own precomputed
+// slots, so the result doesn't depend on the number of threads
+void radixSort(const vector<uint32_t> &keys, int bits, vector<uint32_t> &order,
+               vector<uint32_t> &scratch) {
+  int n = order.size();
+  int numBlocks = threadPool().size();
+  vector<int> offsets(numBlocks * 256);
+  scratch.resize(n);
+
+  for (int shift = 0; shift < bits; shift += 8) {
+    fill(offsets.begin(), offsets.end(), 0);
+    parallelFor(numBlocks, 1, [&](int begin, int end) {
+      for (int b = begin; b < end; b++) {
+        int *count = &offsets[b * 256];
+        int first = (int)((int64_t)n * b / numBlocks), last = (int)((int64_t)n * (b + 1) / numBlocks);
+        for (int i = first; i < last; i++) {
+          count[(keys[order[i]] >> shift) & 255]++;
+        }
+      }
+    });
+
+    // digit-major, block-minor prefix sum turns counts into write positions
+    int total = 0;
+    for (int digit = 0; digit < 256; digit++) {
+      for (int b = 0; b < numBlocks; b++) {
+        int count = offsets[b * 256 + digit];
+        offsets[b * 256 + digit] = total;
+        total += count;
+      }
+    }
+
+    parallelFor(numBlocks, 1, [&](int begin, int end) {
+      for (int b = begin; b < end; b++) {
+        int *next = &offsets[b * 256];
+        int first = (int)((int64_t)n * b / numBlocks), last = (int)((int64_t)n * (b + 1) / numBlocks);
+        for (int i = first; i < last; i++) {
+          scratch[next[(keys[order[i]] >> shift) & 255]++] = order[i];
+        }
+      }
+    });
+    order.swap(scratch);
+  }
+}
+
+// moves points toward *target a chunk at a time. a chunk is settled once
+// every coordinate is within settleEpsilon of the target and is then skipped
+// until the next to(), so a finished morph costs nothing
+struct PixelMorph {
+  static const int chunkSize = 4096;
+  const float settleEpsilon = 1e-4;
+  const vector<Vec3f> *target = nullptr;
+  vector<char> chunkSettled;
+  int settledChunks = 0;
+
+  void to(const vector<Vec3f> &layout) {
+    target = &layout;
+    chunkSettled.assign((layout.size() + chunkSize - 1) / chunkSize, 0);
+    settledChunks = 0;
+  }
+
+  void step(vector<Vec3f> &points, float amount) {
+    int numChunks = chunkSettled.size();
+    if (settledChunks == numChunks) {
+      return;
+    }
+
+    // flat float views so the inner loop is a plain vectorizable axpy
+    float *v = points[0].elems();
+    const float *t = (*target)[0].elems();
+    int numFloats = 3 * points.size();
+    parallelFor(numChunks, 1, [&](int begin, int end) {
+      for (int c = begin; c < end; c++) {
+        if (chunkSettled[c]) {
+          continue;
+        }
+        int first = 3 * c * chunkSize;
+        int last = min(numFloats, first + 3 * chunkSize);
+        // an integer or-reduction, unlike a float max, vectorizes without
+        // -ffast-math
+        int moving = 0;
+        for (int k = first; k < last; k++) {
+          float d = t[k] - v[k];
+          v[k] += d * amount;
+          moving |= fabsf(d) >= settleEpsilon;
+        }
+        if (!moving) {
+          copy(t + first, t + last, v + first);
+          chunkSettled[c] = 1;
+        }
+      }
+    });
+    settledChunks = count(chunkSettled.begin(), chunkSettled.end(), 1);
+  }
+};
+
+// fills every layout but sorted, and the colors, from width x height 8 bit
+// pixels `channels` bytes apart: 3 for plain RGB, 4 for al::Image's RGBA.
+// rows are split across threads, the caller sizes everything
+void fillLayouts(const uint8_t *pixels, int channels, int width, int height,
+                 Layouts &layouts, vector<Color> &colors) {
+  auto aspect_ratio = 1.0f * width / height;
+  parallelFor(height, max(1, minPixelsPerThread / width), [&](int rowBegin, int rowEnd) {
+    for (int j = rowBegin; j < rowEnd; j++) {
+      for (int i = 0; i < width; i++) {
+        int index = j * width + i;
+        const uint8_t *pixel = pixels + (size_t)index * channels; // 0-255
+        float r = pixel[0] / 255.0, g = pixel[1] / 255.0, b = pixel[2] / 255.0;
+        colors[index] = Color(r, g, b);
+
+        layouts.original[index] = Vec3f(1.0 * i / width * aspect_ratio, 1.0 * j / height, 0);
+        layouts.rgb[index] = Vec3f(r - 0.5, g - 0.5, b - 0.5);
+
+        HSV hsvC(RGB(r, g, b));
+        float cosH = cos(hsvC.h*2*M_PI), sinH = sin(hsvC.h*2*M_PI);
+        float cosS = cos(hsvC.s*2*M_PI), sinS = sin(hsvC.s*2*M_PI);
+        layouts.hsv[index] = Vec3f(hsvC.s * cosH, hsvC.v - 0.5, hsvC.s * sinH);
+        layouts.your_style[index] = Vec3f(hsvC.v * sinH * cosS, hsvC.v * cosH, hsvC.v * sinH * sinS);
+      }
+    }
+  });
+}
 
 struct AlloApp : App {
   Parameter pointSize{"/pointSize", "", 1.0, 0.1, 3.0};
   Parameter timeStep{"/timeStep", "", 0.1, 0.01, 0.6};
+  ParameterInt sortKey{"/sortKey", "", 0, 0, 2};    // luminance, hue, saturation
+  ParameterInt sortMode{"/sortMode", "", 0, 0, 2};  // whole image, row intervals, column intervals
+  Parameter threshold{"/threshold", "", 0.25, 0.0, 1.0};
   //
 
   ShaderProgram pointShader;
@@ -28,17 +184,24 @@ struct AlloApp : App {
     auto &gui = GUIdomain->newGUI();
     gui.add(pointSize);  // add parameter to GUI
     gui.add(timeStep);   // add parameter to GUI
+    gui.add(sortKey);
+    gui.add(sortMode);
+    gui.add(threshold);
     //
   }
 
-  // a mesh for every style
   Mesh current;
-  Mesh original;
-  Mesh rgb;
-  Mesh hsv;
-  Mesh your_style;
+  Layouts layouts;
+  int width = 0;
+  int height = 0;
 
-  vector<Vec3f> target;
+  // scratch for sortPixels, kept so re-sorting doesn't allocate
+  vector<uint32_t> keys;
+  vector<uint32_t> segments;
+  vector<uint32_t> order;
+  vector<uint32_t> scratch;
+
+  PixelMorph morph;
 
   void onCreate() override {
     pointShader.compile(slurp("../point-vertex.glsl"),
@@ -53,65 +216,110 @@ struct AlloApp : App {
       cout << "did not load image" << endl;
       exit(1);
     }
-    auto aspect_ratio = 1.0f * image.width() / image.height();
-    for (int j = 0; j < image.height(); j++) {
-      for (int i = 0; i < image.width(); i++) {
-        auto pixel = image.at(i, j); // 0-255 (unsigned char / uint8)
-        current.vertex(1.0 * i / image.width() * aspect_ratio, 1.0 * j / image.height(), 0);
-        current.color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
-        current.texCoord(0.05, 0);  // s, t
-
-        original.vertex(1.0 * i / image.width() * aspect_ratio, 1.0 * j / image.height(), 0);
-        original.color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
-        original.texCoord(0.05, 0);  // s, t
-      
-        rgb.vertex(pixel.r / 255.0 - 0.5, pixel.g / 255.0 - 0.5, pixel.b / 255.0 - 0.5);
-        rgb.color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
-        rgb.texCoord(0.05, 0);
-
-        HSV hsvC(RGB(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0));
-        float x = hsvC.s * cos(hsvC.h*2*M_PI);
-        float y = hsvC.v - 0.5;
-        float z = hsvC.s * sin(hsvC.h*2*M_PI);
-
-        hsv.vertex(x, y, z);
-        hsv.color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
-        hsv.texCoord(0.05, 0);
-
-        x = hsvC.v * sin(hsvC.h*2*M_PI) * cos(hsvC.s*2*M_PI);
-        y = hsvC.v * cos(hsvC.h*2*M_PI);
-        z = hsvC.v * sin(hsvC.h*2*M_PI) * sin(hsvC.s*2*M_PI);
-
-        your_style.vertex(x, y, z);
-        your_style.color(pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0);
-        your_style.texCoord(0.05, 0);
+    width = image.width();
+    height = image.height();
+    int n = width * height;
+
+    // everything is sized once up front and filled in place
+    layouts.resize(n);
+    current.vertices().resize(n);
+    current.colors().resize(n);
+    current.texCoord2s().assign(n, Vec2f(0.05, 0));  // s, t
+
+    fillLayouts(image.array().data(), 4, width, height, layouts, current.colors());
+    current.vertices() = layouts.original;
+    morph.to(layouts.original);
+
+    nav().pos(0, 0, 5);
+  }
+
+  // the grid position of the k-th slot when slots run along rows or columns
+  int slotIndex(int k, bool columns) const {
+    return columns ? (k % height) * width + k / height : k;
+  }
+
+  // fills layouts.sorted with the pixels reordered by the selected key. in
+  // the interval modes only runs of pixels brighter than threshold along a
+  // row or column are sorted; everything else keeps its place
+  void sortPixels() {
+    int n = current.vertices().size();
+    int key = sortKey;
+    int mode = sortMode;
+    bool columns = mode == 2;
+    keys.resize(n);
+    parallelFor(n, minPixelsPerThread, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        const Color &c = current.colors()[i];
+        float value;
+        if (key == 0) {
+          value = 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+        } else {
+          HSV hsvC(RGB(c.r, c.g, c.b));
+          value = key == 1 ? hsvC.h : hsvC.s;
+        }
+        keys[i] = uint32_t(min(max(value, 0.0f), 1.0f) * 65535);
+      }
+    });
+
+    order.resize(n);
+    for (int k = 0; k < n; k++) {
+      order[k] = slotIndex(k, columns);
+    }
+    radixSort(keys, 16, order, scratch);
+
+    if (mode != 0) {
+      // number the intervals in slot order; a pixel below the threshold is an
+      // interval of its own, and so is the start of every row or column
+      int lineLength = columns ? height : width;
+      float limit = threshold;
+      segments.resize(n);
+      uint32_t segment = 0;
+      bool inRun = false;
+      for (int k = 0; k < n; k++) {
+        int i = slotIndex(k, columns);
+        const Color &c = current.colors()[i];
+        bool bright = 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b > limit;
+        if (!bright || !inRun || k % lineLength == 0) {
+          segment++;
+        }
+        inRun = bright;
+        segments[i] = segment;
       }
+      int bits = 0;
+      while (bits < 32 && (segment >> bits) != 0) {
+        bits += 8;
+      }
+      // stable, so pixels stay ordered by key within each interval
+      radixSort(segments, bits, order, scratch);
     }
-    target = current.vertices();
 
-    nav().pos(0, 0, 5);
+    parallelFor(n, minPixelsPerThread, [&](int begin, int end) {
+      for (int k = begin; k < end; k++) {
+        layouts.sorted[order[k]] = layouts.original[slotIndex(k, columns)];
+      }
+    });
   }
 
   void onAnimate(double dt) override {
-    for (int i = 0; i < current.vertices().size(); i++) {
-      Vec3f &v = current.vertices()[i];
-      Vec3f &t = target[i];
-      v.lerp(t, dt);
-    }
+    morph.step(current.vertices(), dt);
   }
 
   bool onKeyDown(const Keyboard &k) override {
     if (k.key() == '1') {
-      target = original.vertices();
+      morph.to(layouts.original);
     }
     if (k.key() == '2') {
-      target = rgb.vertices();
+      morph.to(layouts.rgb);
     }
     if (k.key() == '3') {
-      target = hsv.vertices();
+      morph.to(layouts.hsv);
     }
     if (k.key() == '4') {
-      target = your_style.vertices();
+      morph.to(layouts.your_style);
+    }
+    if (k.key() == '5') {
+      sortPixels();
+      morph.to(layouts.sorted);
     }
     return true;
   }
@@ -128,19 +336,101 @@ struct AlloApp : App {
   }
 };
 
-int main() {
-  AlloApp app;
-  app.configureAudio(48000, 512, 2, 0);
-  app.start();
+// radixSort against std::stable_sort on a 1M pixel image's worth of 16 bit
+// keys with plenty of ties, and on 24 bit keys like the interval numbers,
+// with the pool at 1 and 7 threads: a stable sort has exactly one answer,
+// so every run has to match it. then both sorts are timed
+void checkRadixSort(CheckResults &check) {
+  const int n = 1000000;
+  vector<uint32_t> keys16(n), keys24(n), start(n);
+  for (int i = 0; i < n; i++) {
+    keys16[i] = uint32_t(rnd::uniform() * 4096) * 16;
+    keys24[i] = uint32_t(rnd::uniform() * 16777215);
+    start[i] = (uint32_t)((i * 7919LL) % n);
+  }
+
+  int savedThreads = threadCount();
+  const int threads[] = {1, 7};
+  vector<uint32_t> order, scratch;
+  for (int bits : {16, 24}) {
+    const vector<uint32_t> &keys = bits == 16 ? keys16 : keys24;
+    vector<uint32_t> expected = start;
+    stable_sort(expected.begin(), expected.end(),
+                [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+    for (int t : threads) {
+      setThreadCount(t);
+      order = start;
+      radixSort(keys, bits, order, scratch);
+      check.expect(order == expected, "radix sort: %d bit keys on %d thread%s match std::stable_sort",
+                   bits, t, t == 1 ? "" : "s");
+    }
+  }
+  setThreadCount(savedThreads);
+
+  runHeadless("radix sort", n, 20, 1 / 60.0, [&](double) {
+    order = start;
+    radixSort(keys16, 16, order, scratch);
+  });
+  runHeadless("std::stable_sort", n, 20, 1 / 60.0, [&](double) {
+    order = start;
+    stable_sort(order.begin(), order.end(),
+                [&](uint32_t a, uint32_t b) { return keys16[a] < keys16[b]; });
+  });
 }
 
-string slurp(string fileName) {
-  fstream file(fileName);
-  string returnValue = "";
-  while (file.good()) {
-    string line;
-    getline(file, line);
-    returnValue += line + "\n";
+int runChecks() {
+  CheckResults check;
+  checkRadixSort(check);
+  return check.exitCode();
+}
+
+int main(int argc, char *argv[]) {
+  parseThreads(argc, argv);
+  HeadlessOptions headless = parseHeadless(argc, argv);
+  if (headless.check) {
+    return runChecks();
   }
-  return returnValue;
+  if (headless.frames > 0) {
+    // morphs between two random layouts, switching every 120 frames so the
+    // timings cover both moving and settled points
+    for (int n : headless.sizesOr(1000000)) {
+      vector<Vec3f> layoutA(n), layoutB(n), points(n);
+      for (int i = 0; i < n; i++) {
+        layoutA[i] = Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS());
+        layoutB[i] = Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS());
+      }
+      points = layoutA;
+      PixelMorph morph;
+      int frame = 0;
+      runHeadless("pixel-morph", n, headless.frames, 0.1, [&](double dt) {
+        if (frame % 120 == 0) {
+          morph.to(frame / 120 % 2 == 0 ? layoutB : layoutA);
+        }
+        frame++;
+        morph.step(points, dt);
+      });
+    }
+
+    // the loader's fill from a raw RGB buffer, 0.5 to 24 megapixels at 4:3
+    // unless sizes were given. it runs once per image, so a few frames do
+    for (int pixels : headless.sizesOr({500000, 2000000, 8000000, 24000000})) {
+      int width = (int)sqrt(pixels * 4.0 / 3.0);
+      int height = pixels / width;
+      vector<uint8_t> rgb(3 * (size_t)width * height);
+      for (auto &byte : rgb) {
+        byte = rnd::uniform() * 255;
+      }
+      Layouts layouts;
+      layouts.resize(width * height);
+      vector<Color> colors(width * height);
+      runHeadless("pixel fill", width * height, min(headless.frames, 10), 0.1, [&](double) {
+        fillLayouts(rgb.data(), 3, width, height, layouts, colors);
+      });
+    }
+    return 0;
+  }
+
+  AlloApp app;
+  app.configureAudio(48000, 512, 2, 0);
+  app.start();
 }
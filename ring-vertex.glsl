@@ -0,0 +1,26 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+
+uniform int trailLength;
+uniform int slotSize;
+uniform int head;
+
+out Vertex {
+  vec4 color;
+}
+vertex;
+
+void main() {
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(vertexPosition, 1.0);
+
+  // points are stored slot by slot and head is the newest slot, same as
+  // TrailRing: depth 0 is the newest frame and fades to 0 at the oldest
+  int slot = gl_VertexID / slotSize;
+  int depth = (slot - head + trailLength) % trailLength;
+  float fade = 1.0 - depth / float(trailLength - 1);
+  vertex.color = vec4(fade);
+}
@@ -0,0 +1,63 @@
+#ifndef RUN_CONFIG_HPP
+#define RUN_CONFIG_HPP
+
+// particle and trail counts picked at launch instead of at compile time:
+//
+//     app --particles 20000 --trail 60
+//     app --config sphere.cfg    (lines like "particles 20000" and "trail 60")
+//
+// later arguments win. counts are clamped to the largest capacity the app
+// builds its distributed state for, with a warning, and a config file that
+// can't be read is an error
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+struct RunConfig {
+    int particles;
+    int trailLength;
+
+    RunConfig(int defaultParticles, int defaultTrailLength)
+        : particles(defaultParticles), trailLength(defaultTrailLength) {}
+
+    bool load(const std::string& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string key;
+        int value;
+        while (file >> key >> value) {
+            if (key == "particles") particles = value;
+            if (key == "trail") trailLength = value;
+        }
+        return file.eof();
+    }
+
+    // false if a --config file couldn't be read, after saying so
+    bool parse(int argc, char* argv[]) {
+        for (int i = 1; i + 1 < argc; i++) {
+            if (std::strcmp(argv[i], "--config") == 0 && !load(argv[i + 1])) {
+                std::cerr << "could not read config file " << argv[i + 1] << std::endl;
+                return false;
+            }
+            if (std::strcmp(argv[i], "--particles") == 0) particles = std::atoi(argv[i + 1]);
+            if (std::strcmp(argv[i], "--trail") == 0) trailLength = std::atoi(argv[i + 1]);
+        }
+        return true;
+    }
+
+    void clamp(int maxParticles, int maxTrailLength) {
+        if (particles > maxParticles) {
+            std::cerr << particles << " particles is more than the largest capacity, " << maxParticles << std::endl;
+        }
+        particles = std::max(1, std::min(particles, maxParticles));
+        trailLength = std::max(1, std::min(trailLength, maxTrailLength));
+    }
+};
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SLURP_HPP
+#define SLURP_HPP
+
+// reads a whole text file, shader sources mostly. a missing file comes back
+// as a single newline and the shader compile reports it
+
+#include <fstream>
+#include <string>
+
+inline std::string slurp(std::string fileName) {
+    std::fstream file(fileName);
+    std::string returnValue = "";
+    while (file.good()) {
+        std::string line;
+        getline(file, line);
+        returnValue += line + "\n";
+    }
+    return returnValue;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef TRAIL_CHUNKS_HPP
+#define TRAIL_CHUNKS_HPP
+
+// CPU side of trail culling: particles are split into chunks of
+// consecutive indices, every chunk keeps a bounding sphere around all of its
+// trail points, and a view frustum says which chunks can be seen. no GL
+// here, the renderer decides what to do with the answer
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "al/math/al_Mat.hpp"
+#include "al/math/al_Vec.hpp"
+
+struct BoundingSphere {
+    al::Vec3f center;
+    float radius = 0;
+};
+
+// the six planes of a view frustum, normals pointing in
+struct Frustum {
+    al::Vec4f planes[6];
+
+    // planes straight from the rows of projection * view (Gribb & Hartmann)
+    static Frustum fromMatrix(const al::Mat4f& m) {
+        Frustum f;
+        for (int p = 0; p < 6; p++) {
+            int row = p / 2;
+            float sign = p % 2 == 0 ? 1 : -1;
+            al::Vec4f plane;
+            for (int col = 0; col < 4; col++) {
+                plane[col] = m(3, col) + sign * m(row, col);
+            }
+            float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+            f.planes[p] = plane / length;
+        }
+        return f;
+    }
+
+    bool intersects(const BoundingSphere& s) const {
+        for (int p = 0; p < 6; p++) {
+            const al::Vec4f& plane = planes[p];
+            float distance = plane[0] * s.center.x + plane[1] * s.center.y + plane[2] * s.center.z + plane[3];
+            if (distance < -s.radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+struct TrailChunks {
+    static const int chunkSize = 256; // particles per chunk
+
+    int numParticles = 0;
+    int trailLength = 0;
+    int numChunks = 0;
+    std::vector<BoundingSphere> slotBounds; // [slot * numChunks + chunk], one frame of one chunk
+    std::vector<BoundingSphere> bounds;     // per chunk, every slot
+
+    void resize(int particles, int length) {
+        numParticles = particles;
+        trailLength = length;
+        numChunks = (particles + chunkSize - 1) / chunkSize;
+        slotBounds.assign(numChunks * trailLength, BoundingSphere());
+        bounds.assign(numChunks, BoundingSphere());
+    }
+
+    int begin(int chunk) const { return chunk * chunkSize; }
+    int end(int chunk) const { return std::min(numParticles, (chunk + 1) * chunkSize); }
+
+    // bounds the positions just written to slot, then rebuilds every chunk's
+    // sphere from its slots. both spheres are centroid plus farthest point,
+    // not minimal, but never too small
+    void update(const al::Vec3f* positions, int slot) {
+        for (int c = 0; c < numChunks; c++) {
+            al::Vec3f center(0);
+            for (int i = begin(c); i < end(c); i++) {
+                center += positions[i];
+            }
+            center /= float(end(c) - begin(c));
+            float radiusSqr = 0;
+            for (int i = begin(c); i < end(c); i++) {
+                radiusSqr = std::max(radiusSqr, (positions[i] - center).magSqr());
+            }
+            slotBounds[slot * numChunks + c] = {center, std::sqrt(radiusSqr)};
+        }
+
+        for (int c = 0; c < numChunks; c++) {
+            al::Vec3f center(0);
+            for (int s = 0; s < trailLength; s++) {
+                center += slotBounds[s * numChunks + c].center;
+            }
+            center /= float(trailLength);
+            float radius = 0;
+            for (int s = 0; s < trailLength; s++) {
+                const BoundingSphere& b = slotBounds[s * numChunks + c];
+                radius = std::max(radius, (b.center - center).mag() + b.radius);
+            }
+            bounds[c] = {center, radius};
+        }
+    }
+};
+
+// reorders points along a Morton curve over [-extent, extent]^3 so points
+// with nearby indices are near each other in space, which keeps the chunks
+// compact. ties keep their order, so every machine gets the same result
+inline void mortonSort(al::Vec3f* points, int n, float extent) {
+    auto spread = [](uint32_t v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    auto cell = [extent](float v) {
+        float t = (v + extent) / (2 * extent);
+        return uint32_t(std::min(std::max(t, 0.0f), 1.0f) * 1023);
+    };
+    std::vector<std::pair<uint32_t, al::Vec3f>> keyed(n);
+    for (int i = 0; i < n; i++) {
+        const al::Vec3f& p = points[i];
+        keyed[i] = {spread(cell(p.x)) | spread(cell(p.y)) << 1 | spread(cell(p.z)) << 2, p};
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const std::pair<uint32_t, al::Vec3f>& a, const std::pair<uint32_t, al::Vec3f>& b) {
+                         return a.first < b.first;
+                     });
+    for (int i = 0; i < n; i++) {
+        points[i] = keyed[i].second;
+    }
+}
+
+#endif
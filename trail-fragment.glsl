@@ -0,0 +1,12 @@
+#version 400
+
+in Vertex {
+  vec4 color;
+}
+vertex;
+
+layout(location = 0) out vec4 fragmentColor;
+
+void main() {
+  fragmentColor = vertex.color;
+}
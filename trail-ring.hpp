@@ -0,0 +1,90 @@
+#ifndef TRAIL_RING_HPP
+#define TRAIL_RING_HPP
+
+// trail history for the final-testing sketches in one preallocated buffer,
+// slot by slot: slot s holds every particle's position from one frame. each
+// frame the oldest slot is overwritten with the current positions and
+// becomes the newest, so one slot goes up to the GPU and everything is drawn
+// in one call. ring-vertex.glsl fades each point by the age of its slot,
+// worked out from gl_VertexID and head
+
+#include <string>
+#include <vector>
+
+#include "al/graphics/al_BufferObject.hpp"
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Shader.hpp"
+
+#include "slurp.hpp"
+
+struct TrailRing {
+    int numParticles = 0;
+    int trailLength = 0;
+    int head = 0;    // slot holding the newest positions
+    int pending = 0; // slots advanced since the last upload
+    std::vector<al::Vec3f> points; // [slot * numParticles + particle]
+
+    GLuint vao = 0;
+    al::BufferObject buffer;
+    al::ShaderProgram shader;
+
+    // sizes the ring and empties it, no GL involved
+    void resize(int particles, int length) {
+        numParticles = particles;
+        trailLength = length;
+        head = 0;
+        pending = 0;
+        points.assign(numParticles * trailLength, al::Vec3f(0));
+    }
+
+    void init(int particles, int length, std::string vertexFile, std::string fragmentFile) {
+        resize(particles, length);
+
+        shader.compile(slurp(vertexFile), slurp(fragmentFile));
+
+        buffer.bufferType(GL_ARRAY_BUFFER);
+        buffer.usage(GL_DYNAMIC_DRAW);
+        buffer.create();
+        buffer.bind();
+        buffer.data(sizeof(al::Vec3f) * points.size(), points.data());
+
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glBindVertexArray(0);
+    }
+
+    // recycles the oldest slot as the newest and returns it for the caller
+    // to fill with numParticles positions
+    al::Vec3f* advance() {
+        head = (head + trailLength - 1) % trailLength;
+        pending++;
+        return &points[head * numParticles];
+    }
+
+    // uploads what changed since the last draw, normally just the newest
+    // slot, and draws every slot
+    void draw(al::Graphics& g) {
+        g.shader(shader);
+        g.shader().uniform("trailLength", trailLength);
+        g.shader().uniform("slotSize", numParticles);
+        g.shader().uniform("head", head);
+        g.update();
+
+        buffer.bind();
+        if (pending == 1) {
+            buffer.subdata(sizeof(al::Vec3f) * head * numParticles, sizeof(al::Vec3f) * numParticles,
+                           &points[head * numParticles]);
+        } else if (pending > 1) {
+            buffer.subdata(0, sizeof(al::Vec3f) * points.size(), points.data());
+        }
+        pending = 0;
+
+        glBindVertexArray(vao);
+        glDrawArrays(GL_POINTS, 0, points.size());
+        glBindVertexArray(0);
+    }
+};
+
+#endif
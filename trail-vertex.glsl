@@ -0,0 +1,38 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 2) in vec2 vertexNoise;
+// only x is used (the flicker noise); it is stale when there is no flicker,
+// which flickerIntens zeroes out
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+
+uniform float chaos;
+uniform float flickerIntens;
+uniform int trailLength;
+uniform int head;
+// trails are drawn a chunk at a time: the chunk's points start at chunkFirst
+// and each of its slots holds chunkCount particles
+uniform int chunkFirst;
+uniform int chunkCount;
+
+out Vertex {
+  vec4 color;
+}
+vertex;
+
+void main() {
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(vertexPosition, 1.0);
+
+  // within a chunk trails are stored slot by slot and the slot after head
+  // is the oldest, same as TrailStore::age
+  int slot = (gl_VertexID - chunkFirst) / chunkCount;
+  int age = (slot - head - 1 + 2 * trailLength) % trailLength;
+
+  float noiseVal = 1.0 - flickerIntens * (0.5 + vertexNoise.x);
+  vertex.color = vec4(noiseVal * (0.8 + chaos * 0.2),
+                      noiseVal * (0.8 - chaos * 0.8),
+                      noiseVal * (1.0 - chaos),
+                      age / float(trailLength));
+}